@@ -118,6 +118,7 @@ struct tlbshootdown {
 	 * Change this to what you need for your VM design.
 	 */
 	struct addrspace *ts_addrspace;
+	uint32_t ts_asid;
 	vaddr_t ts_vaddr;
 };
 
@@ -36,6 +36,11 @@
 #include <current.h>
 #include <syscall.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <kmem.h>
+#include <copyinout.h>
+#endif
 
 
 /*
@@ -82,6 +87,11 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+#if OPT_A3
+	off_t retval64;
+	bool is64 = false;
+	int whence;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -146,6 +156,48 @@ syscall(struct trapframe *tf)
 		err = sys_execv((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
 		break;
 #endif //OPT_A2B
+
+#if OPT_A3
+	case SYS_nice:
+		err = sys_nice((int)tf->tf_a0, (int *)&retval);
+		break;
+
+	case SYS_open:
+		err = sys_open((userptr_t)tf->tf_a0, (int)tf->tf_a1,
+			       (mode_t)tf->tf_a2, (int *)&retval);
+		break;
+
+	case SYS_read:
+		err = sys_read((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			       (unsigned int)tf->tf_a2, (int *)&retval);
+		break;
+
+	case SYS_close:
+		err = sys_close((int)tf->tf_a0);
+		break;
+
+	case SYS_lseek:
+		/* the offset is in a2/a3, so whence is on the stack */
+		err = copyin((const_userptr_t)(tf->tf_sp + 16), &whence,
+			     sizeof(int));
+		if (err) {
+			break;
+		}
+		err = sys_lseek((int)tf->tf_a0,
+				((off_t)tf->tf_a2 << 32) | tf->tf_a3,
+				whence, &retval64);
+		is64 = true;
+		break;
+
+	case SYS_dup2:
+		err = sys_dup2((int)tf->tf_a0, (int)tf->tf_a1,
+			       (int *)&retval);
+		break;
+
+	case SYS_pipe:
+		err = sys_pipe((userptr_t)tf->tf_a0, (int *)&retval);
+		break;
+#endif //OPT_A3
  
 	default:
 	  kprintf("Unknown syscall %d\n", callno);
@@ -163,6 +215,14 @@ syscall(struct trapframe *tf)
 		tf->tf_v0 = err;
 		tf->tf_a3 = 1;      /* signal an error */
 	}
+#if OPT_A3
+	else if (is64) {
+		/* 64-bit results come back in v0 (high) and v1 (low) */
+		tf->tf_v0 = (uint32_t)(retval64 >> 32);
+		tf->tf_v1 = (uint32_t)retval64;
+		tf->tf_a3 = 0;      /* signal no error */
+	}
+#endif
 	else {
 		/* Success. */
 		tf->tf_v0 = retval;
@@ -196,6 +256,9 @@ enter_forked_process(void *data1, unsigned long data2) {
 		(void) data2;
 		//copy trap frame onto stack
 		struct trapframe tfStack = *(struct trapframe *)data1;
+	#if OPT_A3
+		kmem_cache_free(trapframe_cache, data1);
+	#endif //OPT_A3
 		tfStack.tf_v0 = 0; // since this is a child process, make the return value 0
 		tfStack.tf_a3 = 0; //set tf_a3 = 0 for no signal error like on line 156
 		tfStack.tf_epc += 4; //advance counter like they did on line 169
@@ -205,3 +268,16 @@ enter_forked_process(void *data1, unsigned long data2) {
 		(void)data2;
 	#endif //OPT_A2
 }
+
+#if OPT_A3
+struct kmem_cache *trapframe_cache;
+
+void
+trapframe_bootstrap(void)
+{
+	trapframe_cache = kmem_cache_create("trapframe", sizeof(struct trapframe), NULL);
+	if (trapframe_cache == NULL) {
+		panic("trapframe_bootstrap: Out of memory\n");
+	}
+}
+#endif //OPT_A3
@@ -32,11 +32,19 @@
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
+#include <cpu.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <uio.h>
+#include <vnode.h>
+#include <uw-vmstats.h>
+#include <swap.h>
+#include <thread.h>
+#include <wchan.h>
 #include "opt-A3.h"
 
 /*
@@ -53,161 +61,1551 @@
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
 #if OPT_A3
-//version 2 of coremap (only check if page is free or not)
+/*
+ * Coremap (version 3): a binary buddy allocator over the frames that
+ * follow the coremap itself.
+ *
+ * A free block of order k covers 2^k frames, starts at a frame index
+ * that is a multiple of 2^k, and is linked into freeLists[k] through
+ * the coremap entry of its first frame. Only that first entry is
+ * marked CM_FREE. An allocated run records its length in its first
+ * entry (CM_ALLOC) so that free_kpages knows how much to give back;
+ * the tail of a rounded-up block is returned to the free lists right
+ * away, so runs that are not a power of two don't waste frames.
+ *
+ * Both allocation and free are O(log n) in the number of frames.
+ *
+ * Frames that back user pages also carry a reference count: after a
+ * fork, parent and child share each frame copy-on-write until one of
+ * them writes to it.
+ *
+ * A frame mapped by exactly one user page also records its owner
+ * (address space and virtual address) so that it can be paged out to
+ * swap. Victims are picked by a clock (second chance) sweep over the
+ * coremap: vm_fault sets cm_referenced whenever it loads a frame into
+ * the TLB, and the clock hand clears it on its first pass.
+ */
+#define CM_MAXORDER 20
+
+#define CM_FREE  0x1 /* heads a free block of order cm_order */
+#define CM_ALLOC 0x2 /* heads an allocated run of cm_npages frames */
+
 struct coreMap {
-	int inUse;
+	int cm_flags;
+	int cm_order;
+	int cm_npages;
+	int cm_refcount; /* user page tables mapping this frame (copy-on-write) */
+	struct addrspace *cm_as; /* owner of an evictable user frame, or NULL */
+	vaddr_t cm_vaddr;
+	bool cm_referenced;
+	bool cm_busy; /* being looked at by the page-out code */
+	int cm_next; /* free list links (frame indices, -1 ends the list) */
+	int cm_prev;
 };
 static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
 struct coreMap *cMap = NULL;
+static int freeLists[CM_MAXORDER + 1];
+static unsigned freeBlocks[CM_MAXORDER + 1];
 bool isBootstrapped = false;
 paddr_t low = 0;
 paddr_t high = 0;
 int pageEntries = 0;
+static int clockHand = 0;
+
+/* Serializes tlb shootdowns sent by the page-out code and waits for them */
+static struct lock *shootdownLock = NULL;
+static struct semaphore *shootdownSem = NULL;
+
+/*
+ * TLB address space IDs. IDs are handed out in order and never reused
+ * within a generation; when they run out a new generation starts, and
+ * each cpu flushes its TLB the first time it activates an address
+ * space from the new generation. ID 0 is never handed out.
+ *
+ * An address space's as_tlbCpus survives it getting a new ID: a cpu
+ * may still be running it under the old one, or hold entries from
+ * before, until it flushes. genFlushedCpus records the cpus that have
+ * flushed since the current generation began, and only those are
+ * dropped when an ID from an older generation is replaced.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asidNext = 1;
+static uint32_t asidGeneration = 1;
+static uint32_t genFlushedCpus = 0;
+
+static int vm_evict(void);
+static void zeropool_bootstrap(void);
+
+/* Push the free block starting at FRAME onto the list for ORDER. */
+static
+void
+cm_listInsert(int frame, int order)
+{
+	cMap[frame].cm_flags = CM_FREE;
+	cMap[frame].cm_order = order;
+	cMap[frame].cm_prev = -1;
+	cMap[frame].cm_next = freeLists[order];
+	if (freeLists[order] >= 0) {
+		cMap[freeLists[order]].cm_prev = frame;
+	}
+	freeLists[order] = frame;
+	freeBlocks[order]++;
+}
+
+/* Unlink the free block starting at FRAME from its list. */
+static
+void
+cm_listRemove(int frame)
+{
+	int order = cMap[frame].cm_order;
+
+	KASSERT(cMap[frame].cm_flags == CM_FREE);
+	if (cMap[frame].cm_prev >= 0) {
+		cMap[cMap[frame].cm_prev].cm_next = cMap[frame].cm_next;
+	} else {
+		freeLists[order] = cMap[frame].cm_next;
+	}
+	if (cMap[frame].cm_next >= 0) {
+		cMap[cMap[frame].cm_next].cm_prev = cMap[frame].cm_prev;
+	}
+	cMap[frame].cm_flags = 0;
+	cMap[frame].cm_next = cMap[frame].cm_prev = -1;
+	freeBlocks[order]--;
+}
+
+/*
+ * Free one aligned block of 2^ORDER frames, merging it with its buddy
+ * for as long as the buddy is free and of the same order.
+ */
+static
+void
+cm_freeBlock(int frame, int order)
+{
+	while (order < CM_MAXORDER) {
+		int buddy = frame ^ (1 << order);
+		if (buddy + (1 << order) > pageEntries) {
+			break;
+		}
+		if (cMap[buddy].cm_flags != CM_FREE || cMap[buddy].cm_order != order) {
+			break;
+		}
+		cm_listRemove(buddy);
+		if (buddy < frame) {
+			frame = buddy;
+		}
+		order++;
+	}
+	cm_listInsert(frame, order);
+}
+
+/*
+ * Free an arbitrary run of frames by splitting it into the largest
+ * aligned power-of-two blocks that fit.
+ */
+static
+void
+cm_freeRange(int frame, int npages)
+{
+	while (npages > 0) {
+		int order = 0;
+		while (order < CM_MAXORDER &&
+		       (frame & ((1 << (order + 1)) - 1)) == 0 &&
+		       (1 << (order + 1)) <= npages) {
+			order++;
+		}
+		cm_freeBlock(frame, order);
+		frame += 1 << order;
+		npages -= 1 << order;
+	}
+}
+
+/*
+ * Allocate NPAGES contiguous frames. Returns the index of the first
+ * frame or -1 if no free block is large enough.
+ */
+static
+int
+cm_allocRun(unsigned long npages)
+{
+	int order = 0;
+	int avail;
+	int frame;
+
+	while ((1UL << order) < npages) {
+		order++;
+		if (order > CM_MAXORDER) {
+			return -1;
+		}
+	}
+
+	//find the smallest free block that is big enough
+	for (avail = order; avail <= CM_MAXORDER; avail++) {
+		if (freeLists[avail] >= 0) {
+			break;
+		}
+	}
+	if (avail > CM_MAXORDER) {
+		return -1;
+	}
+
+	frame = freeLists[avail];
+	cm_listRemove(frame);
+
+	//split it in halves, keeping the lower half each time
+	while (avail > order) {
+		avail--;
+		cm_listInsert(frame + (1 << avail), avail);
+	}
+
+	//hand back the part of the block we don't need
+	if ((1UL << order) > npages) {
+		cm_freeRange(frame + npages, (1 << order) - npages);
+	}
+
+	cMap[frame].cm_flags = CM_ALLOC;
+	cMap[frame].cm_npages = npages;
+	cMap[frame].cm_refcount = 1;
+	return frame;
+}
+#endif
+
+void
+vm_bootstrap(void)
+{
+	#if OPT_A3
+	ram_getsize(&low, &high); //get the starting and ending physical address of memory
+	pageEntries = (high - low) / PAGE_SIZE; //total number of pages including coremap struct
+
+	int cMapSize = pageEntries * sizeof(struct coreMap); //coremap size
+	cMapSize = ROUNDUP(cMapSize, PAGE_SIZE); //make coremap size a multiple of 4096 by rounding it up
+
+	cMap = (struct coreMap *) PADDR_TO_KVADDR(low); //get kernel virtual address of starting point including coremap
+	low += cMapSize; //update starting so that it does not include the coremap (i.e. track memory after the coremap)
+
+	pageEntries = (high - low) / PAGE_SIZE; //get the total number of pages, this time it excludes the coremap
+
+	for (int i = 0; i <= CM_MAXORDER; i++) {
+		freeLists[i] = -1;
+		freeBlocks[i] = 0;
+	}
+	for (int i = 0; i < pageEntries; i++) {
+		cMap[i].cm_flags = 0;
+		cMap[i].cm_order = 0;
+		cMap[i].cm_npages = 0;
+		cMap[i].cm_refcount = 0;
+		cMap[i].cm_as = NULL;
+		cMap[i].cm_vaddr = 0;
+		cMap[i].cm_referenced = false;
+		cMap[i].cm_busy = false;
+		cMap[i].cm_next = -1;
+		cMap[i].cm_prev = -1;
+	}
+	//hand every frame after the coremap to the buddy allocator
+	cm_freeRange(0, pageEntries);
+	isBootstrapped = true; //set bootstrap flag to true (will be used later in getppages)
+
+	vmstats_init();
+
+	shootdownLock = lock_create("shootdownLock");
+	shootdownSem = sem_create("shootdownSem", 0);
+	if (shootdownLock == NULL || shootdownSem == NULL) {
+		panic("vm_bootstrap: could not create tlb shootdown synchronization\n");
+	}
+	swap_bootstrap();
+	zeropool_bootstrap();
+	#endif
+	/* Do nothing. */
+}
+
+#if OPT_A3
+/*
+ * Per-cpu page cache. Single-frame allocations and frees are served
+ * from curcpu->c_pagecache with interrupts off, so the common case
+ * never touches coremap_lock. When the cache runs empty it is refilled
+ * with CPU_PAGECACHE_BATCH frames under one acquisition of the lock;
+ * when it fills up, the same number of frames is drained back.
+ */
+/*
+ * Make a frame coming out of the page cache or the zeroed pool look
+ * like one fresh from cm_allocRun. A user frame freed by frame_decref
+ * arrives with a reference count of 0. Nobody else can see the frame
+ * yet and it has no owner, so vm_evict skips it and no lock is needed.
+ */
+static
+int
+frame_reuse(int frame)
+{
+	KASSERT(cMap[frame].cm_flags == CM_ALLOC);
+	cMap[frame].cm_refcount = 1;
+	cMap[frame].cm_as = NULL;
+	cMap[frame].cm_referenced = false;
+	return frame;
+}
+
+static
+int
+pagecache_get(void)
+{
+	struct cpu *c;
+	int frame = -1;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_pagecache_count == 0) {
+		spinlock_acquire(&coremap_lock);
+		while (c->c_pagecache_count < CPU_PAGECACHE_BATCH) {
+			int f = cm_allocRun(1);
+			if (f < 0) {
+				break;
+			}
+			c->c_pagecache[c->c_pagecache_count++] = f;
+		}
+		spinlock_release(&coremap_lock);
+	}
+	if (c->c_pagecache_count > 0) {
+		frame = frame_reuse(c->c_pagecache[--c->c_pagecache_count]);
+	}
+	splx(spl);
+	return frame;
+}
+
+static
+void
+pagecache_put(int frame)
+{
+	struct cpu *c;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_pagecache_count == CPU_PAGECACHE_SIZE) {
+		spinlock_acquire(&coremap_lock);
+		while (c->c_pagecache_count > CPU_PAGECACHE_SIZE - CPU_PAGECACHE_BATCH) {
+			int f = c->c_pagecache[--c->c_pagecache_count];
+			cMap[f].cm_flags = 0;
+			cMap[f].cm_npages = 0;
+			cm_freeRange(f, 1);
+		}
+		spinlock_release(&coremap_lock);
+	}
+	c->c_pagecache[c->c_pagecache_count++] = frame;
+	splx(spl);
+}
+#endif
+
+#if OPT_A3
+/*
+ * Whole-frame zero and copy. Frames are page aligned and a page is a
+ * whole number of 32-byte cache lines, so unlike bzero and memcpy
+ * these need no alignment or length checks and can move a line per
+ * iteration.
+ */
+void
+page_zero(paddr_t paddr)
+{
+	uint32_t *p = (uint32_t *)PADDR_TO_KVADDR(paddr);
+	uint32_t *end = p + PAGE_SIZE / sizeof(uint32_t);
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	for (; p < end; p += 8) {
+		p[0] = 0;
+		p[1] = 0;
+		p[2] = 0;
+		p[3] = 0;
+		p[4] = 0;
+		p[5] = 0;
+		p[6] = 0;
+		p[7] = 0;
+	}
+}
+
+void
+page_copy(paddr_t dst, paddr_t src)
+{
+	uint32_t *d = (uint32_t *)PADDR_TO_KVADDR(dst);
+	const uint32_t *s = (const uint32_t *)PADDR_TO_KVADDR(src);
+	uint32_t *end = d + PAGE_SIZE / sizeof(uint32_t);
+	uint32_t t0, t1, t2, t3, t4, t5, t6, t7;
+
+	KASSERT((dst & PAGE_FRAME) == dst);
+	KASSERT((src & PAGE_FRAME) == src);
+	for (; d < end; d += 8, s += 8) {
+		//load the whole line before storing any of it
+		t0 = s[0];
+		t1 = s[1];
+		t2 = s[2];
+		t3 = s[3];
+		t4 = s[4];
+		t5 = s[5];
+		t6 = s[6];
+		t7 = s[7];
+		d[0] = t0;
+		d[1] = t1;
+		d[2] = t2;
+		d[3] = t3;
+		d[4] = t4;
+		d[5] = t5;
+		d[6] = t6;
+		d[7] = t7;
+	}
+}
+
+/*
+ * Pool of frames that are already zero. A kernel thread at the lowest
+ * scheduling level tops the pool up to ZEROPOOL_SIZE, so the zeroing
+ * happens when the cpu has nothing better to do instead of in the
+ * page fault handler. Taking the pool below ZEROPOOL_LOW wakes it.
+ *
+ * Pool frames are allocated as far as the coremap is concerned; when
+ * memory runs out, getppages and vm_getUserPage take them back before
+ * paging anything out.
+ */
+#define ZEROPOOL_SIZE 32
+#define ZEROPOOL_LOW  8
+
+static struct spinlock zeropool_lock = SPINLOCK_INITIALIZER;
+static int zeroPool[ZEROPOOL_SIZE];
+static unsigned zeroPoolCount = 0;
+static struct wchan *zeroPoolWchan = NULL;
+
+/*
+ * Take a zeroed frame from the pool. Returns its index, or -1 if the
+ * pool is empty.
+ */
+static
+int
+zeropool_get(void)
+{
+	int frame = -1;
+
+	spinlock_acquire(&zeropool_lock);
+	if (zeroPoolCount > 0) {
+		frame = frame_reuse(zeroPool[--zeroPoolCount]);
+	}
+	if (zeroPoolCount < ZEROPOOL_LOW && zeroPoolWchan != NULL) {
+		wchan_wakeall(zeroPoolWchan);
+	}
+	spinlock_release(&zeropool_lock);
+	return frame;
+}
+
+/*
+ * Sleep until the pool drops below ZEROPOOL_LOW. If RETRY is set, any
+ * zeropool_get will do, because the last allocation failed and more
+ * memory may be free by then.
+ */
+static
+void
+zeropool_wait(bool retry)
+{
+	spinlock_acquire(&zeropool_lock);
+	if (retry || zeroPoolCount >= ZEROPOOL_LOW) {
+		wchan_lock(zeroPoolWchan);
+		spinlock_release(&zeropool_lock);
+		wchan_sleep(zeroPoolWchan);
+		return;
+	}
+	spinlock_release(&zeropool_lock);
+}
+
+static
+void
+zeropool_thread(void *data1, unsigned long data2)
+{
+	int frame;
+	bool full;
+
+	(void)data1;
+	(void)data2;
+
+	thread_nice(THREAD_NPRIO);
+	while (1) {
+		spinlock_acquire(&coremap_lock);
+		frame = cm_allocRun(1);
+		spinlock_release(&coremap_lock);
+		if (frame < 0) {
+			zeropool_wait(true);
+			continue;
+		}
+		page_zero(frame * PAGE_SIZE + low);
+
+		spinlock_acquire(&zeropool_lock);
+		KASSERT(zeroPoolCount < ZEROPOOL_SIZE);
+		zeroPool[zeroPoolCount++] = frame;
+		full = zeroPoolCount == ZEROPOOL_SIZE;
+		spinlock_release(&zeropool_lock);
+
+		if (full) {
+			zeropool_wait(false);
+		}
+	}
+}
+
+static
+void
+zeropool_bootstrap(void)
+{
+	int result;
+
+	zeroPoolWchan = wchan_create("zeropool");
+	if (zeroPoolWchan == NULL) {
+		panic("vm_bootstrap: could not create zeropool wchan\n");
+	}
+	result = thread_fork("zeropool", NULL, zeropool_thread, NULL, 0);
+	if (result) {
+		panic("vm_bootstrap: could not start zeropool thread: %s\n",
+		      strerror(result));
+	}
+}
 #endif
 
+static paddr_t getppages(unsigned long npages) {
+	paddr_t addr;
+
+	#if OPT_A3
+		if (isBootstrapped) {
+			int startFrame;
+			if (npages == 1) {
+				startFrame = pagecache_get();
+			} else {
+				spinlock_acquire(&coremap_lock);
+				startFrame = cm_allocRun(npages);
+				spinlock_release(&coremap_lock);
+			}
+			if (startFrame < 0 && npages == 1) {
+				startFrame = zeropool_get();
+			}
+			if (startFrame >= 0) {
+				//addres of a starting block is: startIndex * pageSize + offset 
+				//(offset is the starting address of memory without the coremap so in this case it's low)
+				addr = (paddr_t) (startFrame * PAGE_SIZE + low);
+			} else {
+				addr = 0;
+				kprintf("Not enough memory available for contiguous pages\n");
+			}
+			return addr;
+		}
+	#endif
+		spinlock_acquire(&stealmem_lock);
+		addr = ram_stealmem(npages);
+		spinlock_release(&stealmem_lock);
+		return addr;
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+	pa = getppages(npages);
+	#if OPT_A3
+		//a single page can be made by paging out a user page, if we're allowed to sleep
+		if (pa == 0 && npages == 1 && isBootstrapped && swap_enabled() &&
+		    !curthread->t_in_interrupt && curthread->t_iplhigh_count == 0) {
+			int frame = vm_evict();
+			if (frame >= 0) {
+				pa = (paddr_t) (frame * PAGE_SIZE + low);
+			}
+		}
+	#endif
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void 
+free_kpages(vaddr_t addr)
+{
+	#if OPT_A3
+		paddr_t physicalAddr = KVADDR_TO_PADDR(addr); //obtain physical address from the kernel virtual address
+		//memory stolen before vm_bootstrap is not tracked by the coremap, so leak it
+		if (physicalAddr < low) {
+			return;
+		}
+		int pageIndex = (physicalAddr - low) / PAGE_SIZE; //get the starting index of the allocated block we want to free
+		KASSERT(pageIndex < pageEntries);
+		//we own the run, so its head entry can't change under us
+		KASSERT(cMap[pageIndex].cm_flags == CM_ALLOC);
+		if (cMap[pageIndex].cm_npages == 1) {
+			pagecache_put(pageIndex);
+			return;
+		}
+		spinlock_acquire(&coremap_lock);
+		int npages = cMap[pageIndex].cm_npages;
+		cMap[pageIndex].cm_flags = 0;
+		cMap[pageIndex].cm_npages = 0;
+		cm_freeRange(pageIndex, npages);
+		spinlock_release(&coremap_lock);
+	#else
+		/* nothing - leak the memory. */
+		(void)addr;
+	#endif
+}
+
+#if OPT_A3
+/*
+ * Reference counting for frames shared copy-on-write between user
+ * address spaces. A frame fresh out of getppages has a count of 1.
+ *
+ * A shared frame has no single owner, so it can't be paged out; we
+ * only know the owner again when a write fault takes the frame over.
+ */
+static
+void
+frame_incref(paddr_t paddr)
+{
+	int frame = (paddr - low) / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cMap[frame].cm_flags == CM_ALLOC && cMap[frame].cm_refcount > 0);
+	cMap[frame].cm_refcount++;
+	cMap[frame].cm_as = NULL;
+	spinlock_release(&coremap_lock);
+}
+
+/* Drop a reference, freeing the frame when the last one goes away. */
+static
+void
+frame_decref(paddr_t paddr)
+{
+	int frame = (paddr - low) / PAGE_SIZE;
+	int refcount;
+
+	spinlock_acquire(&coremap_lock);
+	//the page-out code may be looking at this frame; it will back off
+	//because we hold the owner's as_lock, so just wait for it
+	while (cMap[frame].cm_busy) {
+		spinlock_release(&coremap_lock);
+		thread_yield();
+		spinlock_acquire(&coremap_lock);
+	}
+	KASSERT(cMap[frame].cm_flags == CM_ALLOC && cMap[frame].cm_refcount > 0);
+	refcount = --cMap[frame].cm_refcount;
+	if (refcount == 0) {
+		cMap[frame].cm_as = NULL;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (refcount == 0) {
+		free_kpages(PADDR_TO_KVADDR(paddr));
+	}
+}
+
+static
+int
+frame_refcount(paddr_t paddr)
+{
+	int frame = (paddr - low) / PAGE_SIZE;
+	int refcount;
+
+	spinlock_acquire(&coremap_lock);
+	refcount = cMap[frame].cm_refcount;
+	spinlock_release(&coremap_lock);
+	return refcount;
+}
+
+/*
+ * Record that PADDR is the only frame behind VADDR in AS, which makes
+ * it a candidate for page-out. Must be called after the page table
+ * entry has been updated to point at it.
+ */
+static
+void
+frame_setOwner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	int frame = (paddr - low) / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cMap[frame].cm_flags == CM_ALLOC);
+	if (cMap[frame].cm_refcount == 1) {
+		cMap[frame].cm_as = as;
+		cMap[frame].cm_vaddr = vaddr;
+	}
+	cMap[frame].cm_referenced = true;
+	spinlock_release(&coremap_lock);
+}
+#endif
+
+#if OPT_A3
+/*
+ * Print the free block counts for each buddy order, together with the
+ * share of free memory that is too fragmented to satisfy a request of
+ * that order (i.e. sits in smaller blocks). Frames sitting in per-cpu
+ * page caches or the zeroed pool count as allocated here.
+ */
+void
+coremap_printstats(void)
+{
+	unsigned blocks[CM_MAXORDER + 1];
+	unsigned long freePages = 0;
+	unsigned long smallerPages = 0;
+	unsigned zeroed;
+	int i;
+
+	//snapshot the counts so we don't kprintf while holding a spinlock
+	spinlock_acquire(&coremap_lock);
+	for (i = 0; i <= CM_MAXORDER; i++) {
+		blocks[i] = freeBlocks[i];
+	}
+	spinlock_release(&coremap_lock);
+	spinlock_acquire(&zeropool_lock);
+	zeroed = zeroPoolCount;
+	spinlock_release(&zeropool_lock);
+
+	for (i = 0; i <= CM_MAXORDER; i++) {
+		freePages += (unsigned long) blocks[i] << i;
+	}
+
+	kprintf("Coremap: %d frames, %lu free, %u zeroed\n", pageEntries,
+		freePages, zeroed);
+	kprintf("order  pages  free blocks  unusable\n");
+	for (i = 0; i <= CM_MAXORDER; i++) {
+		unsigned long unusable = 0;
+		if (freePages > 0) {
+			unusable = smallerPages * 100 / freePages;
+		}
+		if (blocks[i] > 0 || (1 << i) <= pageEntries) {
+			kprintf("%5d  %5d  %11u  %7lu%%\n", i, 1 << i, blocks[i], unusable);
+		}
+		smallerPages += (unsigned long) blocks[i] << i;
+	}
+}
+#endif
+
+#if OPT_A3
+/*
+ * Drop every entry from this cpu's TLB. Call with interrupts off.
+ */
+static
+void
+vm_tlbFlush(void)
+{
+	for (int i = 0; i < NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	curcpu->c_tlbhand = 0;
+	curcpu->c_tlbfree = NUM_TLB;
+	tlb_setasid(curcpu->c_asid);
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+}
+
+/*
+ * Drop this cpu's TLB entry for VADDR tagged ASID, if there is one.
+ * Call with interrupts off.
+ */
+static
+void
+vm_tlbInvalidate(uint32_t asid, vaddr_t vaddr)
+{
+	int i;
+
+	i = tlb_probe((vaddr & PAGE_FRAME) | (asid << TLBHI_PIDSHIFT), 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setasid(curcpu->c_asid);
+}
+
+/*
+ * Put a new entry into this cpu's TLB. Slots are handed out round
+ * robin; after a flush the hand walks over free slots first, after
+ * that it replaces the oldest entry. Call with interrupts off.
+ */
+static
+void
+vm_tlbInsert(uint32_t ehi, uint32_t elo)
+{
+	if (curcpu->c_tlbfree > 0) {
+		curcpu->c_tlbfree--;
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+	} else {
+		vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+	}
+	tlb_write(ehi, elo, curcpu->c_tlbhand);
+	curcpu->c_tlbhand = (curcpu->c_tlbhand + 1) % NUM_TLB;
+}
+
+/*
+ * TLB shootdowns are only sent by vm_shootdown below, one at a time,
+ * so each cpu has at most one of ours pending when it gets here.
+ */
+void
+vm_tlbshootdown_all(void)
+{
+	int spl;
+
+	spl = splhigh();
+	vm_tlbFlush();
+	splx(spl);
+	V(shootdownSem);
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	int spl;
+
+	spl = splhigh();
+	vm_tlbInvalidate(ts->ts_asid, ts->ts_vaddr);
+	//we may be running the address space under an ID it has since given up
+	if (curcpu->c_asid != ts->ts_asid &&
+	    curproc_getas() == ts->ts_addrspace) {
+		vm_tlbInvalidate(curcpu->c_asid, ts->ts_vaddr);
+	}
+	splx(spl);
+	V(shootdownSem);
+}
+
+/*
+ * Remove any TLB entry for VADDR in AS from every cpu, and wait until
+ * the other cpus have done so. Only the cpus in as_tlbCpus can have
+ * one, so only they are interrupted.
+ */
+static
+void
+vm_shootdown(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+	uint32_t cpus;
+	int spl;
+	unsigned n;
+
+	spinlock_acquire(&asid_lock);
+	ts.ts_addrspace = as;
+	ts.ts_asid = as->as_asid;
+	ts.ts_vaddr = vaddr;
+	cpus = as->as_tlbCpus;
+	spinlock_release(&asid_lock);
+
+	spl = splhigh();
+	vm_tlbInvalidate(ts.ts_asid, vaddr);
+	cpus &= ~((uint32_t)1 << curcpu->c_number);
+	splx(spl);
+	if (cpus == 0) {
+		return;
+	}
+
+	lock_acquire(shootdownLock);
+	n = ipi_tlbshootdown_broadcast(&ts, cpus);
+	while (n-- > 0) {
+		P(shootdownSem);
+	}
+	lock_release(shootdownLock);
+}
+
+/*
+ * Make AS take a fresh ID the next time it is activated, which makes
+ * every TLB entry it has anywhere unreachable. Cheaper than a
+ * shootdown when many of its mappings change at once.
+ */
+static
+void
+as_retireAsid(struct addrspace *as)
+{
+	spinlock_acquire(&asid_lock);
+	as->as_asidGen = 0;
+	spinlock_release(&asid_lock);
+
+	if (as == curproc_getas()) {
+		as_activate();
+	}
+}
+#else
+void
+vm_tlbshootdown_all(void)
+{
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	(void)ts;
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+#endif
+
+#if OPT_A3
+/*
+ * Find the region of AS that contains VADDR, or NULL if there is none.
+ */
+static
+struct region *
+as_findRegion(struct addrspace *as, vaddr_t vaddr)
+{
+	for (int i = 0; i < AS_NREGIONS; i++) {
+		struct region *r = &as->as_regions[i];
+		if (r->r_npages == 0) {
+			continue;
+		}
+		if (vaddr >= r->r_vbase && vaddr < r->r_vbase + r->r_npages * PAGE_SIZE) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Page out one user frame and hand it to the caller (with a reference
+ * count of 1 and no owner). Returns the frame index, or -1 if there is
+ * no swap space or nothing can be evicted.
+ *
+ * The victim's page table may only be changed while holding its
+ * as_lock. We already hold our own when called from vm_fault; for
+ * anybody else's we only try the lock and move on to the next victim
+ * if it is taken, so two faulting processes can never deadlock on each
+ * other's locks.
+ */
+static
+int
+vm_evict(void)
+{
+	if (!swap_enabled()) {
+		return -1;
+	}
+
+	for (int attempt = 0; attempt < pageEntries; attempt++) {
+		int frame = -1;
+		struct addrspace *as;
+		vaddr_t vaddr;
+		struct region *r;
+		uint32_t *pte;
+		unsigned slot;
+		bool mine;
+		int result;
+
+		//clock sweep: give referenced frames a second chance
+		spinlock_acquire(&coremap_lock);
+		for (int step = 0; step < 2 * pageEntries; step++) {
+			struct coreMap *e = &cMap[clockHand];
+			int here = clockHand;
+			clockHand = (clockHand + 1) % pageEntries;
+			if (e->cm_flags != CM_ALLOC || e->cm_as == NULL ||
+			    e->cm_refcount != 1 || e->cm_busy) {
+				continue;
+			}
+			if (e->cm_referenced) {
+				e->cm_referenced = false;
+				continue;
+			}
+			e->cm_busy = true;
+			frame = here;
+			break;
+		}
+		if (frame < 0) {
+			spinlock_release(&coremap_lock);
+			return -1;
+		}
+		as = cMap[frame].cm_as;
+		vaddr = cMap[frame].cm_vaddr;
+		spinlock_release(&coremap_lock);
+
+		mine = lock_do_i_hold(as->as_lock);
+		if (!mine && !lock_tryacquire(as->as_lock)) {
+			spinlock_acquire(&coremap_lock);
+			cMap[frame].cm_busy = false;
+			spinlock_release(&coremap_lock);
+			continue;
+		}
+
+		r = as_findRegion(as, vaddr);
+		KASSERT(r != NULL);
+		pte = &r->r_pt[(vaddr - r->r_vbase) / PAGE_SIZE];
+		KASSERT((*pte & PTE_VALID) && (*pte & PTE_FRAME) == frame * PAGE_SIZE + low);
+
+		result = swap_alloc(&slot);
+		if (result == 0) {
+			//unmap it everywhere before writing it, so nobody can change it under us
+			*pte = PTE_MKSWAP(slot);
+			vm_shootdown(as, vaddr);
+			result = swap_pageout(frame * PAGE_SIZE + low, slot);
+			if (result) {
+				kprintf("dumbvm: swap write failed: %s\n", strerror(result));
+				*pte = ((frame * PAGE_SIZE + low) & PTE_FRAME) | PTE_VALID;
+				swap_decref(slot);
+			}
+		}
+
+		spinlock_acquire(&coremap_lock);
+		if (result == 0) {
+			cMap[frame].cm_as = NULL;
+			cMap[frame].cm_referenced = false;
+		}
+		cMap[frame].cm_busy = false;
+		spinlock_release(&coremap_lock);
+
+		if (!mine) {
+			lock_release(as->as_lock);
+		}
+		return result ? -1 : frame;
+	}
+	return -1;
+}
+
+/*
+ * Get a frame for a user page, paging something else out if memory
+ * is full. The caller sets the owner with frame_setOwner once the page
+ * table entry points at it.
+ */
+static
+paddr_t
+vm_getUserPage(void)
+{
+	int frame = pagecache_get();
+
+	if (frame < 0) {
+		frame = zeropool_get();
+	}
+	if (frame < 0) {
+		frame = vm_evict();
+	}
+	if (frame < 0) {
+		return 0;
+	}
+	return (paddr_t) (frame * PAGE_SIZE + low);
+}
+
+/*
+ * Get a zero-filled frame for a user page, from the pool if it has
+ * one, otherwise by zeroing one here.
+ */
+static
+paddr_t
+vm_getZeroedPage(void)
+{
+	int frame = zeropool_get();
+	paddr_t paddr;
+
+	if (frame >= 0) {
+		return (paddr_t) (frame * PAGE_SIZE + low);
+	}
+	paddr = vm_getUserPage();
+	if (paddr != 0) {
+		page_zero(paddr);
+	}
+	return paddr;
+}
+
+/*
+ * Bring in the page at VADDR (page aligned) of region R for the first
+ * time: grab a frame, then either read it from the executable or just
+ * zero it. Hands back the new page table entry in RET.
+ */
+static
+int
+vm_pageIn(struct addrspace *as, struct region *r, vaddr_t vaddr, uint32_t *ret)
+{
+	paddr_t paddr;
+	vaddr_t start, end;
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	paddr = vm_getZeroedPage();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+	//the part of this page that the executable has data for (if any)
+	start = vaddr;
+	end = vaddr + PAGE_SIZE;
+	if (start < r->r_filevaddr) {
+		start = r->r_filevaddr;
+	}
+	if (end > r->r_filevaddr + r->r_filesize) {
+		end = r->r_filevaddr + r->r_filesize;
+	}
+
+	if (as->as_vnode == NULL || r->r_filesize == 0 || start >= end) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+	} else {
+		uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr + (start - vaddr)),
+			  end - start, r->r_offset + (start - r->r_filevaddr), UIO_READ);
+		result = VOP_READ(as->as_vnode, &ku);
+		if (result) {
+			free_kpages(PADDR_TO_KVADDR(paddr));
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			/* short read; problem with executable? */
+			kprintf("ELF: short read on segment - file truncated?\n");
+			free_kpages(PADDR_TO_KVADDR(paddr));
+			return ENOEXEC;
+		}
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		vmstats_inc(VMSTAT_ELF_FILE_READ);
+	}
+
+	*ret = (paddr & PTE_FRAME) | PTE_VALID;
+	return 0;
+}
+
+/*
+ * Read a paged-out page back into a fresh, private frame. The swap
+ * slot may still be shared with forked copies of this address space.
+ */
+static
+int
+vm_swapIn(uint32_t *pte)
+{
+	unsigned slot = PTE_SLOT(*pte);
+	paddr_t paddr;
+	int result;
+
+	KASSERT(*pte & PTE_SWAPPED);
+
+	paddr = vm_getUserPage();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+	result = swap_pagein(paddr, slot);
+	if (result) {
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		return result;
+	}
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	swap_decref(slot);
+
+	*pte = (paddr & PTE_FRAME) | PTE_VALID;
+	return 0;
+}
+
+/*
+ * Give AS its own copy of the copy-on-write page at VADDR, described
+ * by PTE. If nobody else maps the frame any more we can simply take it
+ * over.
+ */
+static
+int
+vm_breakCow(struct addrspace *as, vaddr_t vaddr, uint32_t *pte)
+{
+	paddr_t oldpaddr = *pte & PTE_FRAME;
+	paddr_t newpaddr;
+
+	KASSERT(*pte & PTE_COW);
+	if (frame_refcount(oldpaddr) == 1) {
+		*pte &= ~PTE_COW;
+		return 0;
+	}
+
+	newpaddr = vm_getUserPage();
+	if (newpaddr == 0) {
+		return ENOMEM;
+	}
+	page_copy(newpaddr, oldpaddr);
+	*pte = (newpaddr & PTE_FRAME) | PTE_VALID;
+	frame_decref(oldpaddr);
+
+	//other cpus may still map the old frame for us
+	vm_shootdown(as, vaddr);
+	return 0;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *r;
+	uint32_t *pte;
+	paddr_t paddr;
+	uint32_t ehi, elo;
+	int i, spl, result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	r = as_findRegion(as, faultaddress);
+	if (r == NULL || r->r_pt == NULL) {
+		return EFAULT;
+	}
+
+	lock_acquire(as->as_lock);
+	pte = &r->r_pt[(faultaddress - r->r_vbase) / PAGE_SIZE];
+
+	if (faulttype == VM_FAULT_READONLY) {
+		//only copy-on-write pages may be written after a readonly fault, anything
+		//else is a bad memory reference because the memory really is read only
+		if ((*pte & PTE_VALID) == 0 || (*pte & PTE_COW) == 0) {
+			lock_release(as->as_lock);
+			return EFAULT;
+		}
+	} else {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+
+		//map the page on first touch, otherwise just reload the TLB
+		if (*pte & PTE_SWAPPED) {
+			result = vm_swapIn(pte);
+		} else if ((*pte & PTE_VALID) == 0) {
+			result = vm_pageIn(as, r, faultaddress, pte);
+		} else {
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+			result = 0;
+		}
+		if (result) {
+			lock_release(as->as_lock);
+			return result;
+		}
+	}
+
+	//copy a shared page before letting anyone write to it
+	if ((*pte & PTE_COW) && faulttype != VM_FAULT_READ) {
+		result = vm_breakCow(as, faultaddress, pte);
+		if (result) {
+			lock_release(as->as_lock);
+			return result;
+		}
+	}
+	paddr = *pte & PTE_FRAME;
+	frame_setOwner(paddr, as, faultaddress);
+
+	/* make sure it's page-aligned */
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	if ((as->as_isLoadElfComplete && !r->r_writeable) || (*pte & PTE_COW)) {
+		elo &= ~TLBLO_DIRTY;
+	}
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	ehi = faultaddress | (curcpu->c_asid << TLBHI_PIDSHIFT);
+
+	//a readonly fault replaces the existing (read-only) entry in place
+	i = -1;
+	if (faulttype == VM_FAULT_READONLY) {
+		i = tlb_probe(ehi, 0);
+	}
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+	} else {
+		vm_tlbInsert(ehi, elo);
+	}
+
+	splx(spl);
+	lock_release(as->as_lock);
+	return 0;
+}
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	if (as==NULL) {
+		return NULL;
+	}
+
+	as->as_lock = lock_create("as_lock");
+	if (as->as_lock == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	for (int i = 0; i < AS_NREGIONS; i++) {
+		struct region *r = &as->as_regions[i];
+		r->r_vbase = 0;
+		r->r_npages = 0;
+		r->r_writeable = false;
+		r->r_pt = NULL;
+		r->r_filevaddr = 0;
+		r->r_offset = 0;
+		r->r_filesize = 0;
+	}
+	as->as_vnode = NULL;
+	as->as_isLoadElfComplete = false;
+	as->as_asid = 0;
+	as->as_asidGen = 0;
+	as->as_tlbCpus = 0;
+
+	return as;
+}
+
 void
-vm_bootstrap(void)
+as_destroy(struct addrspace *as)
 {
-	#if OPT_A3
-	ram_getsize(&low, &high); //get the starting and ending physical address of memory
-	pageEntries = (high - low) / PAGE_SIZE; //total number of pages including coremap struct
-	//kprintf("Total pages with coremap: %d\n", pageEntries);
+	lock_acquire(as->as_lock);
+	for (int i = 0; i < AS_NREGIONS; i++) {
+		struct region *r = &as->as_regions[i];
+		if (r->r_pt == NULL) {
+			continue;
+		}
+		for (size_t j = 0; j < r->r_npages; j++) {
+			if (r->r_pt[j] & PTE_VALID) {
+				frame_decref(r->r_pt[j] & PTE_FRAME);
+			} else if (r->r_pt[j] & PTE_SWAPPED) {
+				swap_decref(PTE_SLOT(r->r_pt[j]));
+			}
+		}
+		kfree(r->r_pt);
+		r->r_pt = NULL;
+	}
+	lock_release(as->as_lock);
 
-	int cMapSize = pageEntries * sizeof(struct coreMap); //coremap size
-	cMapSize = ROUNDUP(cMapSize, PAGE_SIZE); //make coremap size a multiple of 4096 by rounding it up
-	//kprintf("cMap size: %d\n", cMapSize);
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
+	}
+	lock_destroy(as->as_lock);
+	kfree(as);
+}
 
-	cMap = (struct coreMap *) PADDR_TO_KVADDR(low); //get kernel virtual address of starting point including coremap
-	low += cMapSize; //update starting so that it does not include the coremap (i.e. track memory after the coremap)
+void
+as_activate(void)
+{
+	int spl;
+	bool flush;
+	struct addrspace *as;
 
-	pageEntries = (high - low) / PAGE_SIZE; //get the total number of pages, this time it excludes the coremap
-	//kprintf("New total pages size without coremap: %d\n", pageEntries);
+	as = curproc_getas();
+#ifdef UW
+        /* Kernel threads don't have an address spaces to activate */
+#endif
+	if (as == NULL) {
+		return;
+	}
 
-	//initialize all pages after the coremap to 0 (i.e to denote free pages)
-	for (int i = 0; i < pageEntries; i++) {
-		cMap[i].inUse = 0;
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	//entries of other address spaces are tagged with their own IDs, so
+	//switching only needs a flush when this cpu is behind a generation
+	spinlock_acquire(&asid_lock);
+	if (as->as_asidGen != asidGeneration) {
+		//a retired ID (generation 0) is from this generation, so nobody
+		//has flushed since; otherwise forget the cpus that have
+		if (as->as_asidGen != 0) {
+			as->as_tlbCpus &= ~genFlushedCpus;
+		}
+		if (asidNext == NUM_ASID) {
+			asidGeneration++;
+			asidNext = 1;
+			genFlushedCpus = 0;
+		}
+		as->as_asid = asidNext++;
+		as->as_asidGen = asidGeneration;
 	}
-	isBootstrapped = true; //set bootstrap flag to true (will be used later in )
-	#endif
-	/* Do nothing. */
+	as->as_tlbCpus |= (uint32_t)1 << curcpu->c_number;
+	flush = curcpu->c_asidgen != asidGeneration;
+	if (flush) {
+		genFlushedCpus |= (uint32_t)1 << curcpu->c_number;
+	}
+	curcpu->c_asidgen = asidGeneration;
+	curcpu->c_asid = as->as_asid;
+	spinlock_release(&asid_lock);
+
+	if (flush) {
+		vm_tlbFlush();
+	} else {
+		tlb_setasid(curcpu->c_asid);
+	}
+
+	splx(spl);
 }
 
-static paddr_t getppages(unsigned long npages) {
-	paddr_t addr;
+void
+as_deactivate(void)
+{
+	/* nothing */
+}
 
-	spinlock_acquire(&stealmem_lock);
-	#if OPT_A3
-		if (isBootstrapped) {
-			//kprintf("pages to print %lu\n", npages);
-			spinlock_acquire(&coremap_lock);
-			unsigned long count = npages;
-			bool actualStart = true;
-			int startFrame = 0;
-			//according to A3 guide, we are implementing contiguous memory so we don't need to 
-			//check explicitly for paging. Only need to find a contiguous block of size npages.
-			for (int i = 0; i < pageEntries; i++) {
-				if (count == 0) {
-					break;
-				}
-				if (cMap[i].inUse == 0) {
-					count--;
-					if (actualStart) {
-						startFrame = i;
-						actualStart = false;
-					}
-				} else {
-					count = npages;
-					actualStart = true;
-				}
-			}
-			if (count == 0) {
-				//addres of a starting block is: startIndex * pageSize + offset 
-				//(offset is the starting address of memory without the coremap so in this case it's low)
-				addr = (paddr_t) (startFrame * PAGE_SIZE + low);
-				// int addr2 = (int) addr;
-				// kprintf("starting address of block: %d\n", addr2);
-				// kprintf("index of starting block: %d\n", startFrame);
-				
-				//update the coremap so that it occupies a block of npages contiguously
-				int indx = startFrame;
-				for (unsigned long i = 1; i <= npages; i++) {
-					cMap[indx].inUse = (int) i;
-					++indx;
-				}
-				// //print coreMap
-				// for (int i = 0; i < pageEntries; i++) {
-				// 	kprintf("[%d]: %d\n", i, cMap[i].inUse);
-				// }
-			} else {
-				addr = 0;
-				kprintf("Not enough memory available for contiguous pages\n");
-			}
-			spinlock_release(&coremap_lock);
-		} else {
-			addr = ram_stealmem(npages);
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	size_t npages; 
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	npages = sz / PAGE_SIZE;
+
+	//nothing gets copied through uiomove anymore, so check for kernel addresses here
+	if (vaddr + sz > USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE || vaddr + sz < vaddr) {
+		return EFAULT;
+	}
+
+	(void)readable;
+	(void)executable;
+
+	for (int i = 0; i < AS_STACK; i++) {
+		struct region *r = &as->as_regions[i];
+		if (r->r_npages == 0) {
+			r->r_vbase = vaddr;
+			r->r_npages = npages;
+			r->r_writeable = writeable != 0;
+			return 0;
 		}
-	#else
-		addr = ram_stealmem(npages);
-	#endif
-		spinlock_release(&stealmem_lock);
-		return addr;
+	}
+
+	/*
+	 * Support for more than two regions is not available.
+	 */
+	kprintf("dumbvm: Warning: too many regions\n");
+	return EUNIMP;
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
+/*
+ * Remember where the file data for the segment at VADDR lives, so
+ * vm_fault can read it in one page at a time.
+ */
+int
+as_define_backing(struct addrspace *as, struct vnode *v,
+		  off_t offset, vaddr_t vaddr, size_t filesize)
 {
-	paddr_t pa;
-	pa = getppages(npages);
-	if (pa==0) {
-		return 0;
+	struct region *r = as_findRegion(as, vaddr & PAGE_FRAME);
+
+	if (r == NULL || r == &as->as_regions[AS_STACK]) {
+		return EFAULT;
 	}
-	return PADDR_TO_KVADDR(pa);
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	KASSERT(as->as_vnode == v);
+
+	r->r_filevaddr = vaddr;
+	r->r_offset = offset;
+	r->r_filesize = filesize;
+	return 0;
 }
 
-void 
-free_kpages(vaddr_t addr)
+int
+as_prepare_load(struct addrspace *as)
 {
-	#if OPT_A3
-		//kprintf("arguement addr: %d\n", (int) addr);
-		paddr_t physicalAddr = KVADDR_TO_PADDR(addr); //obtain physical address from the kernel virtual address
-		//kprintf("Free block with starting address: %d\n", (int) physicalAddr);
-		spinlock_acquire(&coremap_lock);
-		int pageIndex = (physicalAddr - low) / PAGE_SIZE; //get the starting index of the allocated block we want to free
-		//kprintf("Free block with starting index: %d\n", pageIndex);	
-		//int isPageFree = 0;
-		int currentPage = 0;
-		int successor = 0;
-		//loop until you encounter the end of the contiguous block
-		while (true) {
-			currentPage = cMap[pageIndex].inUse;
-			cMap[pageIndex].inUse = 0;
-			pageIndex++;
-			successor = cMap[pageIndex].inUse;
-			if (successor - currentPage != 1) {
-				break;
-			}
+	struct region *stack = &as->as_regions[AS_STACK];
+
+	stack->r_vbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+	stack->r_npages = DUMBVM_STACKPAGES;
+	stack->r_writeable = true;
+
+	//only the page tables are allocated here, pages come in through vm_fault
+	for (int i = 0; i < AS_NREGIONS; i++) {
+		struct region *r = &as->as_regions[i];
+		if (r->r_npages == 0) {
+			continue;
 		}
-		spinlock_release(&coremap_lock);
-	#else
-		/* nothing - leak the memory. */
-		(void)addr;
-	#endif
+		KASSERT(r->r_pt == NULL);
+		r->r_pt = kmalloc(r->r_npages * sizeof(uint32_t));
+		if (r->r_pt == NULL) {
+			return ENOMEM;
+		}
+		bzero(r->r_pt, r->r_npages * sizeof(uint32_t));
+	}
+
+	return 0;
 }
 
-void
-vm_tlbshootdown_all(void)
+int
+as_complete_load(struct addrspace *as)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	(void)as;
+	return 0;
 }
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	KASSERT(as->as_regions[AS_STACK].r_pt != NULL);
+
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *new;
+
+	new = as_create();
+	if (new==NULL) {
+		return ENOMEM;
+	}
+
+	for (int i = 0; i < AS_NREGIONS; i++) {
+		new->as_regions[i] = old->as_regions[i];
+		new->as_regions[i].r_pt = NULL;
+	}
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
+	}
+	new->as_isLoadElfComplete = old->as_isLoadElfComplete;
+
+	lock_acquire(old->as_lock);
+
+	/* (Mis)use as_prepare_load to allocate the page tables. */
+	if (as_prepare_load(new)) {
+		lock_release(old->as_lock);
+		as_destroy(new);
+		return ENOMEM;
+	}
+
+	//share every frame the parent has touched; writeable ones become copy-on-write
+	//in both address spaces, so this costs one pass over the page tables.
+	//Paged-out pages just share the swap slot.
+	for (int i = 0; i < AS_NREGIONS; i++) {
+		struct region *oldr = &old->as_regions[i];
+		struct region *newr = &new->as_regions[i];
+		for (size_t j = 0; j < newr->r_npages; j++) {
+			if (oldr->r_pt[j] & PTE_SWAPPED) {
+				swap_incref(PTE_SLOT(oldr->r_pt[j]));
+				newr->r_pt[j] = oldr->r_pt[j];
+				continue;
+			}
+			if ((oldr->r_pt[j] & PTE_VALID) == 0) {
+				continue;
+			}
+			frame_incref(oldr->r_pt[j] & PTE_FRAME);
+			if (oldr->r_writeable) {
+				oldr->r_pt[j] |= PTE_COW;
+			}
+			newr->r_pt[j] = oldr->r_pt[j];
+		}
+	}
+
+	//the parent may still have writeable TLB entries for pages that are now
+	//shared, on any cpu it has run on; giving it a new ID orphans all of them
+	as_retireAsid(old);
+	lock_release(old->as_lock);
+
+	*ret = new;
+	return 0;
 }
 
+#else /* OPT_A3 */
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -224,12 +1622,8 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		#if OPT_A3
-			return EFAULT; /* Bad memory reference because memory is read only and you shouldn't write to it*/
-		#else
-			/* We always create pages read-write, so we can't get this */
-			panic("dumbvm: got VM_FAULT_READONLY\n");
-		#endif
+		/* We always create pages read-write, so we can't get this */
+		panic("dumbvm: got VM_FAULT_READONLY\n");
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -302,32 +1696,15 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		}
 		ehi = faultaddress;
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		#if OPT_A3
-			if (as->as_isLoadElfComplete && faultaddress >= vbase1 && faultaddress < vtop1) {
-				elo &= ~TLBLO_DIRTY;
-			}
-		#endif
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
 		splx(spl);
 		return 0;
 	}
 
-	//if TLB is full then write to a random position instead of printing an error.
-	#if  OPT_A3
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		if (as->as_isLoadElfComplete && faultaddress >= vbase1 && faultaddress < vtop1) {
-			elo &= ~TLBLO_DIRTY;
-		}
-		tlb_random(ehi, elo);
-		splx(spl);
-		return 0;
-	#else
-		kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-		splx(spl);
-		return EFAULT;
-	#endif
+	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
+	splx(spl);
+	return EFAULT;
 }
 
 struct addrspace *
@@ -345,9 +1722,6 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
-	#if OPT_A3
-		as->as_isLoadElfComplete = false;
-	#endif
 
 	return as;
 }
@@ -355,12 +1729,7 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
-	#if OPT_A3
-		free_kpages(PADDR_TO_KVADDR(as->as_pbase1));
-		free_kpages(PADDR_TO_KVADDR(as->as_pbase2));
-		free_kpages(PADDR_TO_KVADDR(as->as_stackpbase));
-	#endif
-		kfree(as);
+	kfree(as);
 }
 
 void
@@ -447,21 +1816,16 @@ as_prepare_load(struct addrspace *as)
 	KASSERT(as->as_stackpbase == 0);
 
 	as->as_pbase1 = getppages(as->as_npages1);
-	// kprintf("\nnpages1: %d\n", (int)as->as_npages1);
-	// kprintf("pbase1: %d\n", (int)as->as_pbase1);
 	if (as->as_pbase1 == 0) {
 		return ENOMEM;
 	}
 
 	as->as_pbase2 = getppages(as->as_npages2);
-	// kprintf("\nnpages2: %d\n", (int)as->as_npages2);
-	// kprintf("pbase2: %d\n", (int)as->as_pbase2);
 	if (as->as_pbase2 == 0) {
 		return ENOMEM;
 	}
 
 	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
-	// kprintf("stackpbase: %d\n", (int)as->as_stackpbase);
 	if (as->as_stackpbase == 0) {
 		return ENOMEM;
 	}
@@ -529,3 +1893,5 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	*ret = new;
 	return 0;
 }
+
+#endif /* OPT_A3 */
@@ -53,6 +53,7 @@
 #include <vfs.h>
 #include <emufs.h>
 #include "autoconf.h"
+#include "opt-A3.h"
 
 /* Register offsets */
 #define REG_HANDLE    0
@@ -479,11 +480,30 @@ emufs_reclaim(struct vnode *v)
 	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
+#if OPT_A3
+	/*
+	 * VOP_INCREF doesn't take vfs_biglock any more, so
+	 * emufs_loadvnode may have picked the vnode up again since
+	 * VOP_DECREF decided to reclaim it. If so, consume the
+	 * reference VOP_DECREF gave us.
+	 */
+	spinlock_acquire(&ev->ev_v.vn_countlock);
+	if (ev->ev_v.vn_refcount != 1) {
+		KASSERT(ev->ev_v.vn_refcount > 1);
+		ev->ev_v.vn_refcount--;
+		spinlock_release(&ev->ev_v.vn_countlock);
+		lock_release(ef->ef_emu->e_lock);
+		vfs_biglock_release();
+		return EBUSY;
+	}
+	spinlock_release(&ev->ev_v.vn_countlock);
+#else
 	if (ev->ev_v.vn_refcount != 1) {
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+#endif
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
@@ -36,6 +36,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <synch.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -94,6 +95,108 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 	return EAGAIN;
 }
 
+#if OPT_A3
+/*
+ * Take the next request off the queue, C-LOOK style: the lowest one
+ * at or above the head, or if there isn't one, the lowest of all.
+ * The queue is sorted, so requests for neighbouring sectors are
+ * served back to back.
+ */
+static
+struct lhd_req *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct lhd_req **pp, **best;
+	struct lhd_req *req;
+
+	best = &lh->lh_queue;
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		if ((*pp)->lr_sector >= lh->lh_headpos) {
+			best = pp;
+			break;
+		}
+	}
+
+	req = *best;
+	if (req != NULL) {
+		*best = req->lr_next;
+		req->lr_next = NULL;
+	}
+	return req;
+}
+
+/*
+ * Start the disk on the next sector to do, if there is one. Call
+ * with lh_qlock held while the disk is idle.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	struct lhd_req *req;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_qlock));
+
+	if (lh->lh_active == NULL) {
+		lh->lh_active = lhd_pick(lh);
+		if (lh->lh_active == NULL) {
+			return;
+		}
+	}
+	req = lh->lh_active;
+
+	/* If writing, transfer the data to the on-card buffer. */
+	if (req->lr_write) {
+		memcpy(lh->lh_buf,
+		       (char *)req->lr_buf + req->lr_pos * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want, and start the operation. */
+	lhd_wreg(lh, LHD_REG_SECT, req->lr_sector + req->lr_pos);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Record that a sector has completed. Move on to the next sector of
+ * the request, or finish the request and start the next one.
+ */
+static
+void
+lhd_iodone(struct lhd_softc *lh, int err)
+{
+	struct lhd_req *req;
+
+	spinlock_acquire(&lh->lh_qlock);
+	req = lh->lh_active;
+	KASSERT(req != NULL);
+
+	if (err == 0) {
+		/* If reading, transfer the data out of the buffer. */
+		if (!req->lr_write) {
+			memcpy((char *)req->lr_buf +
+			       req->lr_pos * LHD_SECTSIZE,
+			       lh->lh_buf, LHD_SECTSIZE);
+		}
+		req->lr_pos++;
+		if (req->lr_pos < req->lr_nsect) {
+			lhd_start(lh);
+			spinlock_release(&lh->lh_qlock);
+			return;
+		}
+	}
+
+	lh->lh_active = NULL;
+	lh->lh_headpos = req->lr_sector + req->lr_pos;
+	lhd_start(lh);
+	spinlock_release(&lh->lh_qlock);
+
+	/* The request may be gone once the callback returns. */
+	req->lr_done(req, err);
+}
+#else
 /*
  * Record that an I/O has completed: save the result and poke the
  * completion semaphore.
@@ -105,6 +208,7 @@ lhd_iodone(struct lhd_softc *lh, int err)
 	lh->lh_result = err;
 	V(lh->lh_done);
 }
+#endif /* OPT_A3 */
 
 /*
  * Interrupt handler for lhd.
@@ -193,6 +297,258 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+#if OPT_A3
+#define LHD_BATCH  8    /* requests lhd_io has out at once */
+
+/*
+ * A request lhd_io submits and then sleeps on.
+ */
+struct lhd_syncreq {
+	struct lhd_req sr_req;          /* must be first */
+	struct lhd_softc *sr_lh;
+	bool sr_done;                   /* protected by lh_qlock */
+	int sr_result;
+};
+
+/* Completion callback for lhd_io's requests. */
+static
+void
+lhd_syncDone(struct lhd_req *req, int result)
+{
+	struct lhd_syncreq *sr = (struct lhd_syncreq *)req;
+	struct lhd_softc *lh = sr->sr_lh;
+
+	spinlock_acquire(&lh->lh_qlock);
+	sr->sr_result = result;
+	sr->sr_done = true;
+	wchan_wakeall(lh->lh_wchan);
+	spinlock_release(&lh->lh_qlock);
+}
+
+/*
+ * Submit SRS[0..N-1], which the caller has filled in, and wait for
+ * them all to finish. Returns the first error.
+ */
+static
+int
+lhd_syncRun(struct lhd_softc *lh, struct lhd_syncreq *srs, unsigned n)
+{
+	unsigned i;
+	int result = 0;
+
+	for (i=0; i<n; i++) {
+		srs[i].sr_req.lr_done = lhd_syncDone;
+		srs[i].sr_lh = lh;
+		srs[i].sr_done = false;
+		result = lhd_submit(&lh->lh_dev, &srs[i].sr_req);
+		/* lhd_io already checked the range */
+		KASSERT(result == 0);
+	}
+
+	spinlock_acquire(&lh->lh_qlock);
+	for (i=0; i<n; i++) {
+		while (!srs[i].sr_done) {
+			wchan_lock(lh->lh_wchan);
+			spinlock_release(&lh->lh_qlock);
+			wchan_sleep(lh->lh_wchan);
+			spinlock_acquire(&lh->lh_qlock);
+		}
+		if (srs[i].sr_result && result == 0) {
+			result = srs[i].sr_result;
+		}
+	}
+	spinlock_release(&lh->lh_qlock);
+
+	return result;
+}
+
+/*
+ * Account for AMT bytes moved directly to or from the kernel
+ * buffers of UIO, as uiomove would have.
+ */
+static
+void
+lhd_uioAdvance(struct uio *uio, size_t amt)
+{
+	uio->uio_offset += amt;
+	uio->uio_resid -= amt;
+	while (amt > 0) {
+		struct iovec *iov = uio->uio_iov;
+		size_t len = iov->iov_len < amt ? iov->iov_len : amt;
+
+		iov->iov_kbase = (char *)iov->iov_kbase + len;
+		iov->iov_len -= len;
+		amt -= len;
+		if (iov->iov_len == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+		}
+	}
+}
+
+/*
+ * True if the interrupt handler can move the data of UIO straight
+ * to or from its buffers: it's in the kernel, and split only at
+ * sector boundaries.
+ */
+static
+bool
+lhd_uioDirect(struct uio *uio)
+{
+	unsigned i;
+
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return false;
+	}
+	for (i=0; i<uio->uio_iovcnt; i++) {
+		if (uio->uio_iov[i].iov_len % LHD_SECTSIZE != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * I/O function (for both reads and writes)
+ *
+ * Kernel buffers get one request per iovec, all queued at once, so
+ * the parts of a scattered transfer go through back to back. Other
+ * transfers go through a bounce buffer.
+ */
+static
+int
+lhd_io(struct device *d, struct uio *uio)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct lhd_syncreq srs[LHD_BATCH];
+
+	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
+	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
+	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
+	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
+	bool iswrite = (uio->uio_rw == UIO_WRITE);
+	char *bounce;
+	size_t done, amt;
+	unsigned i, n;
+	int result = 0;
+
+	/* Don't allow I/O that isn't sector-aligned. */
+	if (sectoff != 0 || lenoff != 0) {
+		return EINVAL;
+	}
+
+	/* Don't allow I/O past the end of the disk. */
+	if (sector+len > lh->lh_dev.d_blocks) {
+		return EINVAL;
+	}
+
+	if (lhd_uioDirect(uio)) {
+		while (uio->uio_resid > 0) {
+			sector = uio->uio_offset / LHD_SECTSIZE;
+			done = 0;
+			n = 0;
+			for (i=0; i<uio->uio_iovcnt && n<LHD_BATCH &&
+				     done < uio->uio_resid; i++) {
+				struct iovec *iov = &uio->uio_iov[i];
+
+				amt = iov->iov_len;
+				if (amt > uio->uio_resid - done) {
+					amt = uio->uio_resid - done;
+				}
+				if (amt == 0) {
+					continue;
+				}
+				srs[n].sr_req.lr_sector =
+					sector + done / LHD_SECTSIZE;
+				srs[n].sr_req.lr_nsect = amt / LHD_SECTSIZE;
+				srs[n].sr_req.lr_buf = iov->iov_kbase;
+				srs[n].sr_req.lr_write = iswrite;
+				n++;
+				done += amt;
+			}
+			result = lhd_syncRun(lh, srs, n);
+			if (result) {
+				return result;
+			}
+			lhd_uioAdvance(uio, done);
+		}
+		return 0;
+	}
+
+	bounce = kmalloc(LHD_BATCH * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+	while (uio->uio_resid > 0) {
+		sector = uio->uio_offset / LHD_SECTSIZE;
+		amt = uio->uio_resid;
+		if (amt > LHD_BATCH * LHD_SECTSIZE) {
+			amt = LHD_BATCH * LHD_SECTSIZE;
+		}
+
+		if (iswrite) {
+			result = uiomove(bounce, amt, uio);
+			if (result) {
+				break;
+			}
+		}
+
+		srs[0].sr_req.lr_sector = sector;
+		srs[0].sr_req.lr_nsect = amt / LHD_SECTSIZE;
+		srs[0].sr_req.lr_buf = bounce;
+		srs[0].sr_req.lr_write = iswrite;
+		result = lhd_syncRun(lh, srs, 1);
+		if (result) {
+			break;
+		}
+
+		if (!iswrite) {
+			result = uiomove(bounce, amt, uio);
+			if (result) {
+				break;
+			}
+		}
+	}
+	kfree(bounce);
+
+	return result;
+}
+
+/*
+ * Queue a request. lhd_start is only called here if the disk is
+ * idle; otherwise the interrupt handler gets to it in turn.
+ */
+int
+lhd_submit(struct device *d, struct lhd_req *req)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct lhd_req **pp;
+
+	KASSERT(d->d_io == lhd_io);
+	KASSERT(req->lr_done != NULL);
+
+	if (req->lr_nsect == 0 || req->lr_sector >= d->d_blocks ||
+	    req->lr_nsect > d->d_blocks - req->lr_sector) {
+		return EINVAL;
+	}
+	req->lr_pos = 0;
+
+	spinlock_acquire(&lh->lh_qlock);
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		if ((*pp)->lr_sector > req->lr_sector) {
+			break;
+		}
+	}
+	req->lr_next = *pp;
+	*pp = req;
+	if (lh->lh_active == NULL) {
+		lhd_start(lh);
+	}
+	spinlock_release(&lh->lh_qlock);
+
+	return 0;
+}
+#else
 /*
  * I/O function (for both reads and writes)
  */
@@ -274,6 +630,7 @@ lhd_io(struct device *d, struct uio *uio)
 
 	return 0;
 }
+#endif /* OPT_A3 */
 
 /*
  * Setup routine called by autoconf.c when an lhd is found.
@@ -289,6 +646,17 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
+#if OPT_A3
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_qlock);
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_headpos = 0;
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		return ENOMEM;
+	}
+#else
 	/* Create the semaphores. */
 	lh->lh_clear = sem_create("lhd-clear", 1);
 	if (lh->lh_clear == NULL) {
@@ -300,6 +668,7 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 		lh->lh_clear = NULL;
 		return ENOMEM;
 	}
+#endif
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
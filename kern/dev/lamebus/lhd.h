@@ -31,12 +31,37 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <spinlock.h>
+#include "opt-A3.h"
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+#if OPT_A3
+/*
+ * A request to the disk: LR_NSECT sectors starting at LR_SECTOR,
+ * moved to or from the kernel buffer LR_BUF. Requests are queued and
+ * served in C-LOOK order: upward from where the head is, then back
+ * to the lowest waiting sector. When the request is done, LR_DONE is
+ * called with the result. It's called from the interrupt handler, so
+ * it may not sleep.
+ */
+struct lhd_req {
+	/* Filled in by the caller */
+	uint32_t lr_sector;
+	uint32_t lr_nsect;
+	void *lr_buf;
+	bool lr_write;
+	void (*lr_done)(struct lhd_req *req, int result);
+
+	/* Used by the driver */
+	struct lhd_req *lr_next;        /* in the queue */
+	uint32_t lr_pos;                /* sectors done so far */
+};
+#endif
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +76,17 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
+#if OPT_A3
+	struct spinlock lh_qlock;	/* protects everything below */
+	struct lhd_req *lh_queue;	/* waiting requests, by sector */
+	struct lhd_req *lh_active;	/* request the disk is working on */
+	uint32_t lh_headpos;		/* sector after the last one done */
+	struct wchan *lh_wchan;		/* for lhd_io waiting on requests */
+#else
 	int lh_result;			/* Result from I/O operation */
 	struct semaphore *lh_clear;	/* Synchronization */
 	struct semaphore *lh_done;
+#endif
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -61,4 +94,9 @@ struct lhd_softc {
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+#if OPT_A3
+/* Queue a request without waiting for it. DEV must be an lhd. */
+int lhd_submit(struct device *dev, struct lhd_req *req);
+#endif
+
 #endif /* _LAMEBUS_LHD_H_ */
@@ -0,0 +1,287 @@
+/*
+ * SFS directory name index.
+ *
+ * An in-memory index of one directory's entries, so that looking up
+ * a name, or finding a free slot for a new one, doesn't mean reading
+ * every entry in the directory. Names are found through a hash table
+ * that doubles as the directory grows; slots through an array with
+ * the entry in each slot, or NULL for a free one.
+ *
+ * The index is a copy of what's on disk and has no locking of its
+ * own. sfs_vnode.c builds it the first time the directory is
+ * searched, keeps it up to date in sfs_writedir, and throws it away
+ * when the vnode is reclaimed or when it runs out of memory keeping
+ * it current; all of that happens under the directory's sv_lock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <sfs.h>
+
+#if OPT_A3
+
+#define DIRINDEX_MINBUCKETS  16
+#define DIRINDEX_MINSLOTS    16
+
+struct sfs_dirname {
+	struct sfs_dirname *dn_next;    /* hash chain */
+	uint32_t dn_ino;
+	int dn_slot;
+	char dn_name[SFS_NAMELEN];
+};
+
+struct sfs_dirindex {
+	struct sfs_dirname **di_hash;
+	unsigned di_nbuckets;
+	unsigned di_count;              /* names in the index */
+	struct sfs_dirname **di_slots;  /* by slot; NULL if free */
+	unsigned di_nslots;             /* slots in the directory */
+	unsigned di_maxslots;           /* room in di_slots */
+	unsigned di_freehint;           /* no free slot below this */
+};
+
+static
+unsigned
+dirindex_hashFn(const char *name, unsigned nbuckets)
+{
+	unsigned h = 5381;
+
+	while (*name) {
+		h = h * 33 + (unsigned char)*name++;
+	}
+	return h % nbuckets;
+}
+
+/*
+ * Double the number of hash buckets. Failing is harmless; the chains
+ * just get longer.
+ */
+static
+void
+dirindex_grow(struct sfs_dirindex *di)
+{
+	struct sfs_dirname **newhash, *dn, *next;
+	unsigned newsize = di->di_nbuckets * 2;
+	unsigned i, h;
+
+	newhash = kmalloc(newsize * sizeof(struct sfs_dirname *));
+	if (newhash == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newhash[i] = NULL;
+	}
+
+	for (i=0; i<di->di_nbuckets; i++) {
+		for (dn = di->di_hash[i]; dn != NULL; dn = next) {
+			next = dn->dn_next;
+			h = dirindex_hashFn(dn->dn_name, newsize);
+			dn->dn_next = newhash[h];
+			newhash[h] = dn;
+		}
+	}
+
+	kfree(di->di_hash);
+	di->di_hash = newhash;
+	di->di_nbuckets = newsize;
+}
+
+/*
+ * Make room in di_slots for slot number SLOT.
+ */
+static
+int
+dirindex_reserve(struct sfs_dirindex *di, unsigned slot)
+{
+	struct sfs_dirname **newslots;
+	unsigned newmax, i;
+
+	if (slot < di->di_maxslots) {
+		return 0;
+	}
+
+	newmax = di->di_maxslots * 2;
+	while (newmax <= slot) {
+		newmax *= 2;
+	}
+	newslots = kmalloc(newmax * sizeof(struct sfs_dirname *));
+	if (newslots == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<newmax; i++) {
+		newslots[i] = i < di->di_nslots ? di->di_slots[i] : NULL;
+	}
+
+	kfree(di->di_slots);
+	di->di_slots = newslots;
+	di->di_maxslots = newmax;
+	return 0;
+}
+
+struct sfs_dirindex *
+sfs_dirindex_create(void)
+{
+	struct sfs_dirindex *di;
+	unsigned i;
+
+	di = kmalloc(sizeof(struct sfs_dirindex));
+	if (di == NULL) {
+		return NULL;
+	}
+
+	di->di_hash = kmalloc(DIRINDEX_MINBUCKETS *
+			      sizeof(struct sfs_dirname *));
+	di->di_slots = kmalloc(DIRINDEX_MINSLOTS *
+			       sizeof(struct sfs_dirname *));
+	if (di->di_hash == NULL || di->di_slots == NULL) {
+		if (di->di_hash != NULL) {
+			kfree(di->di_hash);
+		}
+		if (di->di_slots != NULL) {
+			kfree(di->di_slots);
+		}
+		kfree(di);
+		return NULL;
+	}
+	for (i=0; i<DIRINDEX_MINBUCKETS; i++) {
+		di->di_hash[i] = NULL;
+	}
+	di->di_nbuckets = DIRINDEX_MINBUCKETS;
+	di->di_count = 0;
+	di->di_nslots = 0;
+	di->di_maxslots = DIRINDEX_MINSLOTS;
+	di->di_freehint = 0;
+
+	return di;
+}
+
+void
+sfs_dirindex_destroy(struct sfs_dirindex *di)
+{
+	unsigned i;
+
+	for (i=0; i<di->di_nslots; i++) {
+		if (di->di_slots[i] != NULL) {
+			kfree(di->di_slots[i]);
+		}
+	}
+	kfree(di->di_slots);
+	kfree(di->di_hash);
+	kfree(di);
+}
+
+/*
+ * Record that SLOT now holds NAME with inode INO, or that it's free
+ * if INO is SFS_NOINO. Slots past the end of the directory up to
+ * SLOT become part of it, free. On ENOMEM the index no longer
+ * matches the directory and must be thrown away.
+ */
+int
+sfs_dirindex_set(struct sfs_dirindex *di, int slot, uint32_t ino,
+		 const char *name)
+{
+	struct sfs_dirname *dn, **pp;
+	unsigned i;
+	int result;
+
+	KASSERT(slot >= 0);
+
+	result = dirindex_reserve(di, slot);
+	if (result) {
+		return result;
+	}
+	for (i = di->di_nslots; i <= (unsigned)slot; i++) {
+		di->di_slots[i] = NULL;
+	}
+	if ((unsigned)slot >= di->di_nslots) {
+		di->di_nslots = slot + 1;
+	}
+
+	/* Take out whatever the slot held before. */
+	dn = di->di_slots[slot];
+	if (dn != NULL) {
+		pp = &di->di_hash[dirindex_hashFn(dn->dn_name,
+						  di->di_nbuckets)];
+		while (*pp != dn) {
+			KASSERT(*pp != NULL);
+			pp = &(*pp)->dn_next;
+		}
+		*pp = dn->dn_next;
+		di->di_slots[slot] = NULL;
+		di->di_count--;
+		kfree(dn);
+	}
+
+	if (ino == SFS_NOINO) {
+		if ((unsigned)slot < di->di_freehint) {
+			di->di_freehint = slot;
+		}
+		return 0;
+	}
+
+	dn = kmalloc(sizeof(struct sfs_dirname));
+	if (dn == NULL) {
+		return ENOMEM;
+	}
+	dn->dn_ino = ino;
+	dn->dn_slot = slot;
+	KASSERT(strlen(name) < sizeof(dn->dn_name));
+	strcpy(dn->dn_name, name);
+
+	if (di->di_count >= 2 * di->di_nbuckets) {
+		dirindex_grow(di);
+	}
+	pp = &di->di_hash[dirindex_hashFn(dn->dn_name, di->di_nbuckets)];
+	dn->dn_next = *pp;
+	*pp = dn;
+	di->di_slots[slot] = dn;
+	di->di_count++;
+
+	return 0;
+}
+
+/*
+ * Look up NAME. Hands back its inode and slot, either of which may
+ * be NULL.
+ */
+int
+sfs_dirindex_find(struct sfs_dirindex *di, const char *name,
+		  uint32_t *ino, int *slot)
+{
+	struct sfs_dirname *dn;
+
+	dn = di->di_hash[dirindex_hashFn(name, di->di_nbuckets)];
+	for (; dn != NULL; dn = dn->dn_next) {
+		if (!strcmp(dn->dn_name, name)) {
+			if (ino != NULL) {
+				*ino = dn->dn_ino;
+			}
+			if (slot != NULL) {
+				*slot = dn->dn_slot;
+			}
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
+/*
+ * Return a free slot in the directory, or -1 if it's full.
+ */
+int
+sfs_dirindex_freeslot(struct sfs_dirindex *di)
+{
+	unsigned i;
+
+	for (i = di->di_freehint; i < di->di_nslots; i++) {
+		if (di->di_slots[i] == NULL) {
+			di->di_freehint = i;
+			return i;
+		}
+	}
+	di->di_freehint = di->di_nslots;
+	return -1;
+}
+
+#endif /* OPT_A3 */
@@ -39,6 +39,7 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -113,8 +114,13 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs; 
 	unsigned i, num;
 	int result;
+#if OPT_A3
+	struct vnodearray *loaded;
+#endif
 
+#if !OPT_A3
 	vfs_biglock_acquire();
+#endif
 
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
@@ -148,6 +154,64 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
+#if OPT_A3
+	/*
+	 * Go over the loaded vnodes, syncing as we go. VOP_FSYNC takes
+	 * the vnode's lock, which is ordered before the table, so take
+	 * a reference to each and let go of the table first.
+	 */
+	loaded = vnodearray_create();
+	if (loaded == NULL) {
+		return ENOMEM;
+	}
+	rwlock_acquire_read(sfs->sfs_vnlock);
+	num = vnodearray_num(sfs->sfs_vnodes);
+	result = vnodearray_setsize(loaded, num);
+	if (result) {
+		rwlock_release_read(sfs->sfs_vnlock);
+		vnodearray_destroy(loaded);
+		return result;
+	}
+	for (i=0; i<num; i++) {
+		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
+		VOP_INCREF(v);
+		vnodearray_set(loaded, i, v);
+	}
+	rwlock_release_read(sfs->sfs_vnlock);
+
+	for (i=0; i<num; i++) {
+		struct vnode *v = vnodearray_get(loaded, i);
+		VOP_FSYNC(v);
+		VOP_DECREF(v);
+	}
+	vnodearray_setsize(loaded, 0);
+	vnodearray_destroy(loaded);
+
+	/* If the free block map needs to be written, write it. */
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_freemapdirty) {
+		result = sfs_mapio(sfs, UIO_WRITE);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		sfs->sfs_freemapdirty = false;
+	}
+
+	/* If the superblock needs to be written, write it. */
+	if (sfs->sfs_superdirty) {
+		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		sfs->sfs_superdirty = false;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Now get everything that's dirty in the cache onto the disk. */
+	return sfs_bsync(sfs, SFS_NOINO);
+#else
 	/* Go over the array of loaded vnodes, syncing as we go. */
 	num = vnodearray_num(sfs->sfs_vnodes);
 	for (i=0; i<num; i++) {
@@ -177,6 +241,7 @@ sfs_sync(struct fs *fs)
 
 	vfs_biglock_release();
 	return 0;
+#endif /* OPT_A3 */
 }
 
 /*
@@ -191,9 +256,14 @@ sfs_getvolname(struct fs *fs)
 	struct sfs_fs *sfs = fs->fs_data;
 	const char *ret;
 
+#if OPT_A3
+	/* the volume name never changes while mounted */
+	ret = sfs->sfs_super.sp_volname;
+#else
 	vfs_biglock_acquire();
 	ret = sfs->sfs_super.sp_volname;
 	vfs_biglock_release();
+#endif
 
 	return ret;
 }
@@ -212,16 +282,31 @@ sfs_unmount(struct fs *fs)
 	vfs_biglock_acquire();
 	
 	/* Do we have any files open? If so, can't unmount. */
+#if OPT_A3
+	rwlock_acquire_read(sfs->sfs_vnlock);
 	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
+		rwlock_release_read(sfs->sfs_vnlock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	rwlock_release_read(sfs->sfs_vnlock);
+#else
+	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
+		vfs_biglock_release();
+		return EBUSY;
+	}
+#endif
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
 	/* Once we start nuking stuff we can't fail. */
+#if OPT_A3
+	rwlock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_freemaplock);
+	sfs_binvalidate(sfs);
+#endif
 	vnodearray_destroy(sfs->sfs_vnodes);
 	bitmap_destroy(sfs->sfs_freemap);
 	
@@ -256,12 +341,20 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
 	struct sfs_fs *sfs;
+#if OPT_A3
+	unsigned i;
+#endif
 
 	vfs_biglock_acquire();
 
 	/* We don't pass any options through mount */
 	(void)options;
 
+#if OPT_A3
+	/* The first mount sets up the buffer cache. */
+	sfs_bbootstrap();
+#endif
+
 	/*
 	 * Make sure our on-disk structures aren't messed up
 	 */
@@ -347,6 +440,30 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return result;
 	}
 
+#if OPT_A3
+	sfs->sfs_vnlock = rwlock_create("sfs_vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		bitmap_destroy(sfs->sfs_freemap);
+		vnodearray_destroy(sfs->sfs_vnodes);
+		kfree(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+	sfs->sfs_reclaims = 0;
+	for (i=0; i<SFS_VNHASH; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs_freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		rwlock_destroy(sfs->sfs_vnlock);
+		bitmap_destroy(sfs->sfs_freemap);
+		vnodearray_destroy(sfs->sfs_vnodes);
+		kfree(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+#endif
+
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
 	sfs->sfs_absfs.fs_getvolname = sfs_getvolname;
@@ -31,6 +31,8 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
+#include <thread.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -44,20 +46,24 @@
 // initialized, and so may not use anything from sfs
 // except sfs_device.
 
+/*
+ * Do one block of I/O on DEV, retrying on errors. This works on the
+ * device rather than the sfs_fs so the buffer cache can write back
+ * blocks of whatever filesystem a buffer happens to belong to.
+ */
+static
 int
-sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
+sfs_devio(struct device *dev, struct uio *uio)
 {
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n", 
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
 
  retry:
-	result = sfs->sfs_device->d_io(sfs->sfs_device, uio);
+	result = dev->d_io(dev, uio);
 	if (result == EINVAL) {
 		/*
 		 * This means the sector we requested was out of range,
@@ -86,6 +92,757 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	return result;
 }
 
+int
+sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
+{
+#if !OPT_A3
+	KASSERT(vfs_biglock_do_i_hold());
+#endif
+
+	return sfs_devio(sfs->sfs_device, uio);
+}
+
+#if OPT_A3
+////////////////////////////////////////////////////////////
+//
+// Buffer cache
+//
+// Disk blocks are kept in SFS_NBUF buffers, found by (device, block)
+// through a hash table. Buffers nobody is using sit on an LRU list,
+// and a miss recycles the least recently used one, writing it back
+// first if it's dirty. Otherwise dirty buffers stay in memory until
+// sfs_bsync writes them out, for VOP_FSYNC or FSOP_SYNC. Dirty
+// blocks next to each other on disk are written in one request.
+//
+// buf_lock protects the hash table, the LRU list, the read-ahead
+// queue, and the header fields of every buffer. A buffer handed out
+// by sfs_bget or sfs_bread is busy: it's off the LRU list, and it
+// and its data belong to the caller until sfs_brelse. Anyone else
+// wanting it waits on buf_cv.
+
+#define SFS_NBUF      64
+#define SFS_NBUFHASH  32
+#define SFS_CLUSTER   8     /* most blocks in one device request */
+#define SFS_RAQUEUE   64    /* read-ahead requests waiting */
+
+struct sfs_buf {
+	struct sfs_buf *b_hashnext;
+	struct sfs_buf *b_lruprev;
+	struct sfs_buf *b_lrunext;
+	struct device *b_dev;           /* NULL if holding no block */
+	uint32_t b_block;
+	uint32_t b_owner;               /* inode the block belongs to */
+	bool b_valid;                   /* b_data holds the block */
+	bool b_dirty;                   /* b_data newer than the disk */
+	bool b_busy;                    /* handed out; not on the LRU */
+	void *b_data;
+};
+
+static struct sfs_buf buf_table[SFS_NBUF];
+static struct sfs_buf *buf_hash[SFS_NBUFHASH];
+static struct sfs_buf *buf_lruhead;     /* next to be recycled */
+static struct sfs_buf *buf_lrutail;     /* most recently used */
+static struct lock *buf_lock;
+static struct cv *buf_cv;
+
+/*
+ * Blocks queued for the read-ahead thread, and the device it's
+ * reading from right now, if any.
+ */
+static struct {
+	struct device *ra_dev;
+	uint32_t ra_block;
+} ra_queue[SFS_RAQUEUE];
+static unsigned ra_head, ra_count;
+static struct device *ra_curdev;
+static struct cv *ra_cv;
+
+static unsigned buf_hits;
+static unsigned buf_misses;
+static unsigned buf_writebacks;
+static unsigned buf_clusters;
+static unsigned buf_evictions;
+static unsigned buf_readaheads;
+
+static
+unsigned
+buf_hashFn(struct device *dev, uint32_t block)
+{
+	return (((uintptr_t)dev >> 4) + block) % SFS_NBUFHASH;
+}
+
+static
+struct sfs_buf *
+buf_find(struct device *dev, uint32_t block)
+{
+	struct sfs_buf *b;
+
+	for (b = buf_hash[buf_hashFn(dev, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buf_hashInsert(struct sfs_buf *b)
+{
+	unsigned h = buf_hashFn(b->b_dev, b->b_block);
+
+	b->b_hashnext = buf_hash[h];
+	buf_hash[h] = b;
+}
+
+static
+void
+buf_hashRemove(struct sfs_buf *b)
+{
+	struct sfs_buf **pp;
+
+	pp = &buf_hash[buf_hashFn(b->b_dev, b->b_block)];
+	while (*pp != b) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+buf_lruRemove(struct sfs_buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buf_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buf_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/* Put B at the recently used end of the LRU list. */
+static
+void
+buf_lruAppend(struct sfs_buf *b)
+{
+	b->b_lruprev = buf_lrutail;
+	b->b_lrunext = NULL;
+	if (buf_lrutail != NULL) {
+		buf_lrutail->b_lrunext = b;
+	}
+	else {
+		buf_lruhead = b;
+	}
+	buf_lrutail = b;
+}
+
+/* Put B where it'll be recycled first. */
+static
+void
+buf_lruPrepend(struct sfs_buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buf_lruhead;
+	if (buf_lruhead != NULL) {
+		buf_lruhead->b_lruprev = b;
+	}
+	else {
+		buf_lrutail = b;
+	}
+	buf_lruhead = b;
+}
+
+/* Take B off the LRU list for the caller. Call with buf_lock held. */
+static
+void
+buf_grab(struct sfs_buf *b)
+{
+	KASSERT(!b->b_busy);
+	buf_lruRemove(b);
+	b->b_busy = true;
+}
+
+/* Give B back. Call with buf_lock held. */
+static
+void
+buf_ungrab(struct sfs_buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	if (b->b_valid) {
+		buf_lruAppend(b);
+	}
+	else {
+		if (b->b_dev != NULL) {
+			buf_hashRemove(b);
+			b->b_dev = NULL;
+		}
+		buf_lruPrepend(b);
+	}
+	cv_broadcast(buf_cv, buf_lock);
+}
+
+/*
+ * Read or write N busy buffers holding consecutive blocks of one
+ * device, as a single request. Called without buf_lock; the buffers
+ * being busy keeps everyone else off them.
+ */
+static
+int
+buf_io(struct sfs_buf **bufs, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[SFS_CLUSTER];
+	struct uio ku;
+	unsigned i;
+
+	KASSERT(n > 0 && n <= SFS_CLUSTER);
+	for (i=0; i<n; i++) {
+		KASSERT(bufs[i]->b_busy);
+		KASSERT(bufs[i]->b_dev == bufs[0]->b_dev);
+		KASSERT(bufs[i]->b_block == bufs[0]->b_block + i);
+		iov[i].iov_kbase = bufs[i]->b_data;
+		iov[i].iov_len = SFS_BLOCKSIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = ((off_t)bufs[0]->b_block) * SFS_BLOCKSIZE;
+	ku.uio_resid = n * SFS_BLOCKSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+	return sfs_devio(bufs[0]->b_dev, &ku);
+}
+
+/* True if B is a dirty buffer nobody's using. */
+static
+bool
+buf_idleDirty(struct sfs_buf *b)
+{
+	return b != NULL && !b->b_busy && b->b_dirty;
+}
+
+/*
+ * Write back busy, dirty buffer B, together with the idle dirty
+ * buffers for the blocks on either side of it, in one request.
+ * Called with buf_lock held; drops it during the I/O. B stays busy;
+ * the others are given back.
+ */
+static
+int
+buf_writeCluster(struct sfs_buf *b)
+{
+	struct sfs_buf *run[SFS_CLUSTER];
+	unsigned before, n, i;
+	int result;
+
+	KASSERT(b->b_busy && b->b_dirty);
+
+	/* See how far back the run goes, then collect it in order. */
+	before = 0;
+	while (before + 1 < SFS_CLUSTER && b->b_block > before &&
+	       buf_idleDirty(buf_find(b->b_dev, b->b_block - before - 1))) {
+		before++;
+	}
+	n = 0;
+	for (i=before; i>0; i--) {
+		run[n] = buf_find(b->b_dev, b->b_block - i);
+		buf_grab(run[n++]);
+	}
+	run[n++] = b;
+	while (n < SFS_CLUSTER) {
+		struct sfs_buf *nb;
+
+		nb = buf_find(b->b_dev, b->b_block + (n - before));
+		if (!buf_idleDirty(nb)) {
+			break;
+		}
+		buf_grab(nb);
+		run[n++] = nb;
+	}
+
+	lock_release(buf_lock);
+	result = buf_io(run, n, UIO_WRITE);
+	lock_acquire(buf_lock);
+
+	for (i=0; i<n; i++) {
+		if (result == 0) {
+			run[i]->b_dirty = false;
+			buf_writebacks++;
+		}
+		if (run[i] != b) {
+			buf_ungrab(run[i]);
+		}
+	}
+	if (n > 1) {
+		buf_clusters++;
+	}
+	return result;
+}
+
+/*
+ * Find or make the buffer for BLOCK of DEV and hand it back busy.
+ * Called with buf_lock held, which may be dropped along the way. If
+ * CANWAIT is false, gives up and hands back NULL rather than wait
+ * for a buffer to come free.
+ */
+static
+int
+buf_get(struct device *dev, uint32_t block, bool canwait,
+	struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	while (1) {
+		b = buf_find(dev, block);
+		if (b != NULL) {
+			if (b->b_busy) {
+				if (!canwait) {
+					*ret = NULL;
+					return 0;
+				}
+				cv_wait(buf_cv, buf_lock);
+				continue;
+			}
+			buf_hits++;
+			buf_grab(b);
+			*ret = b;
+			return 0;
+		}
+
+		b = buf_lruhead;
+		if (b == NULL) {
+			/* every buffer is in use */
+			if (!canwait) {
+				*ret = NULL;
+				return 0;
+			}
+			cv_wait(buf_cv, buf_lock);
+			continue;
+		}
+		buf_grab(b);
+
+		if (b->b_dirty) {
+			/*
+			 * Write it back. While we sleep someone else may
+			 * bring in BLOCK, so once it's clean put it back
+			 * at the head of the list and look again.
+			 */
+			result = buf_writeCluster(b);
+			if (result) {
+				/* leave it dirty for sfs_bsync to retry */
+				buf_ungrab(b);
+				return result;
+			}
+			buf_ungrab(b);
+			buf_lruRemove(b);
+			buf_lruPrepend(b);
+			continue;
+		}
+
+		if (b->b_dev != NULL) {
+			buf_hashRemove(b);
+			buf_evictions++;
+		}
+		b->b_dev = dev;
+		b->b_block = block;
+		b->b_owner = SFS_NOINO;
+		b->b_valid = false;
+		buf_hashInsert(b);
+		buf_misses++;
+		*ret = b;
+		return 0;
+	}
+}
+
+/*
+ * The read-ahead thread. Takes runs of consecutive blocks off
+ * ra_queue and reads each run into the cache in one request. Blocks
+ * already cached, or that would mean waiting for a buffer, are
+ * skipped; read-ahead is only ever a hint.
+ */
+static
+void
+buf_readaheadThread(void *unused1, unsigned long unused2)
+{
+	struct sfs_buf *run[SFS_CLUSTER];
+	struct sfs_buf *b;
+	struct device *dev = NULL;
+	uint32_t block;
+	unsigned n, i;
+	int result;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(buf_lock);
+	while (1) {
+		while (ra_count == 0) {
+			cv_wait(ra_cv, buf_lock);
+		}
+
+		n = 0;
+		while (ra_count > 0 && n < SFS_CLUSTER) {
+			block = ra_queue[ra_head].ra_block;
+			if (n == 0) {
+				dev = ra_queue[ra_head].ra_dev;
+				ra_curdev = dev;
+			}
+			else if (ra_queue[ra_head].ra_dev != dev ||
+				 block != run[n-1]->b_block + 1) {
+				break;
+			}
+			ra_head = (ra_head + 1) % SFS_RAQUEUE;
+			ra_count--;
+
+			if (buf_find(dev, block) != NULL) {
+				/* cached already, or being read */
+				if (n > 0) {
+					break;
+				}
+				continue;
+			}
+			result = buf_get(dev, block, false, &b);
+			if (result || b == NULL) {
+				break;
+			}
+			if (b->b_valid) {
+				/* someone read it in while we slept */
+				buf_ungrab(b);
+				break;
+			}
+			run[n++] = b;
+		}
+
+		if (n > 0) {
+			lock_release(buf_lock);
+			result = buf_io(run, n, UIO_READ);
+			lock_acquire(buf_lock);
+			for (i=0; i<n; i++) {
+				if (result == 0) {
+					run[i]->b_valid = true;
+					buf_readaheads++;
+				}
+				buf_ungrab(run[i]);
+			}
+		}
+
+		ra_curdev = NULL;
+		cv_broadcast(buf_cv, buf_lock);
+	}
+}
+
+void
+sfs_bbootstrap(void)
+{
+	unsigned i;
+	int result;
+
+	if (buf_lock != NULL) {
+		/* already done by an earlier mount */
+		return;
+	}
+
+	buf_lock = lock_create("sfs_buf");
+	buf_cv = cv_create("sfs_buf");
+	ra_cv = cv_create("sfs_readahead");
+	if (buf_lock == NULL || buf_cv == NULL || ra_cv == NULL) {
+		panic("sfs_bbootstrap: Out of memory\n");
+	}
+
+	for (i=0; i<SFS_NBUF; i++) {
+		struct sfs_buf *b = &buf_table[i];
+
+		b->b_data = kmalloc(SFS_BLOCKSIZE);
+		if (b->b_data == NULL) {
+			panic("sfs_bbootstrap: Out of memory\n");
+		}
+		b->b_hashnext = NULL;
+		b->b_dev = NULL;
+		b->b_block = 0;
+		b->b_owner = SFS_NOINO;
+		b->b_valid = false;
+		b->b_dirty = false;
+		b->b_busy = false;
+		buf_lruAppend(b);
+	}
+
+	result = thread_fork("sfs_readahead", NULL, buf_readaheadThread,
+			     NULL, 0);
+	if (result) {
+		panic("sfs_bbootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
+/*
+ * Get the buffer for BLOCK without reading it in. If it wasn't
+ * already cached, the buffer comes back with sfs_bvalid false; the
+ * caller either fills all of it and calls sfs_bdirty or releases it
+ * unused.
+ */
+int
+sfs_bget(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	int result;
+
+	lock_acquire(buf_lock);
+	result = buf_get(sfs->sfs_device, block, true, ret);
+	lock_release(buf_lock);
+	return result;
+}
+
+/*
+ * Get the buffer for BLOCK with the block's contents in it.
+ */
+int
+sfs_bread(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	result = sfs_bget(sfs, block, &b);
+	if (result) {
+		return result;
+	}
+
+	if (!b->b_valid) {
+		result = buf_io(&b, 1, UIO_READ);
+		if (result) {
+			sfs_brelse(b);
+			return result;
+		}
+		b->b_valid = true;
+	}
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Ask for BLOCKS[0..N-1] to be read into the cache in the
+ * background. Blocks that don't fit in the queue are dropped.
+ */
+void
+sfs_breadahead(struct sfs_fs *sfs, const uint32_t *blocks, unsigned n)
+{
+	struct device *dev = sfs->sfs_device;
+	unsigned i, slot;
+
+	lock_acquire(buf_lock);
+	for (i=0; i<n && ra_count < SFS_RAQUEUE; i++) {
+		if (buf_find(dev, blocks[i]) != NULL) {
+			continue;
+		}
+		slot = (ra_head + ra_count) % SFS_RAQUEUE;
+		ra_queue[slot].ra_dev = dev;
+		ra_queue[slot].ra_block = blocks[i];
+		ra_count++;
+	}
+	cv_signal(ra_cv, buf_lock);
+	lock_release(buf_lock);
+}
+
+void *
+sfs_bdata(struct sfs_buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+bool
+sfs_bvalid(struct sfs_buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_valid;
+}
+
+/*
+ * Mark a buffer's contents as modified. OWNER is the inode whose
+ * VOP_FSYNC should write it out, or SFS_NOINO for filesystem
+ * metadata, which only FSOP_SYNC writes.
+ */
+void
+sfs_bdirty(struct sfs_buf *b, uint32_t owner)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+	b->b_dirty = true;
+	b->b_owner = owner;
+}
+
+void
+sfs_brelse(struct sfs_buf *b)
+{
+	lock_acquire(buf_lock);
+	buf_ungrab(b);
+	lock_release(buf_lock);
+}
+
+static
+bool
+buf_needsSync(struct sfs_buf *b, struct device *dev, uint32_t owner)
+{
+	if (b->b_dev != dev || !b->b_dirty) {
+		return false;
+	}
+	return owner == SFS_NOINO || b->b_owner == owner;
+}
+
+/*
+ * Write back the dirty buffers of SFS belonging to inode OWNER, or
+ * all of them if OWNER is SFS_NOINO. Returns the first error, but
+ * carries on with the rest.
+ */
+int
+sfs_bsync(struct sfs_fs *sfs, uint32_t owner)
+{
+	struct device *dev = sfs->sfs_device;
+	struct sfs_buf *b;
+	unsigned i;
+	int result = 0, err;
+
+	lock_acquire(buf_lock);
+	for (i=0; i<SFS_NBUF; i++) {
+		b = &buf_table[i];
+		while (buf_needsSync(b, dev, owner) && b->b_busy) {
+			cv_wait(buf_cv, buf_lock);
+		}
+		if (!buf_needsSync(b, dev, owner)) {
+			continue;
+		}
+
+		buf_grab(b);
+		err = buf_writeCluster(b);
+		if (err && result == 0) {
+			result = err;
+		}
+		buf_ungrab(b);
+	}
+	lock_release(buf_lock);
+
+	return result;
+}
+
+/*
+ * Drop every buffer of SFS from the cache. Called at unmount, after
+ * the final sync, so nothing should be in use or dirty.
+ */
+void
+sfs_binvalidate(struct sfs_fs *sfs)
+{
+	struct device *dev = sfs->sfs_device;
+	struct sfs_buf *b;
+	unsigned i, j, n;
+
+	lock_acquire(buf_lock);
+
+	/* Call off any read-ahead for the device. */
+	n = ra_count;
+	ra_count = 0;
+	for (i=0; i<n; i++) {
+		j = (ra_head + i) % SFS_RAQUEUE;
+		if (ra_queue[j].ra_dev != dev) {
+			ra_queue[(ra_head + ra_count) % SFS_RAQUEUE] =
+				ra_queue[j];
+			ra_count++;
+		}
+	}
+	while (ra_curdev == dev) {
+		cv_wait(buf_cv, buf_lock);
+	}
+
+	for (i=0; i<SFS_NBUF; i++) {
+		b = &buf_table[i];
+		if (b->b_dev != dev) {
+			continue;
+		}
+		KASSERT(!b->b_busy);
+		KASSERT(!b->b_dirty);
+		buf_hashRemove(b);
+		b->b_dev = NULL;
+		b->b_valid = false;
+		buf_lruRemove(b);
+		buf_lruPrepend(b);
+	}
+	lock_release(buf_lock);
+}
+
+void
+sfs_bstats(void)
+{
+	unsigned dirty = 0, busy = 0, i;
+
+	lock_acquire(buf_lock);
+	for (i=0; i<SFS_NBUF; i++) {
+		if (buf_table[i].b_dirty) {
+			dirty++;
+		}
+		if (buf_table[i].b_busy) {
+			busy++;
+		}
+	}
+	kprintf("sfs buffer cache: %u buffers, %u dirty, %u busy\n",
+		SFS_NBUF, dirty, busy);
+	kprintf("    %u hits, %u misses, %u evictions\n",
+		buf_hits, buf_misses, buf_evictions);
+	kprintf("    %u blocks written back (%u clustered writes), "
+		"%u blocks read ahead\n",
+		buf_writebacks, buf_clusters, buf_readaheads);
+	lock_release(buf_lock);
+}
+
+/*
+ * The whole-block helpers go through the cache. Writes only dirty
+ * the buffer; the block reaches the disk at the next sync or when
+ * the buffer is recycled.
+ */
+
+int
+sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block)
+{
+	struct sfs_buf *b;
+	int result;
+
+	result = sfs_bread(sfs, block, &b);
+	if (result) {
+		return result;
+	}
+	memcpy(data, b->b_data, SFS_BLOCKSIZE);
+	sfs_brelse(b);
+	return 0;
+}
+
+int
+sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block)
+{
+	struct sfs_buf *b;
+	int result;
+
+	result = sfs_bget(sfs, block, &b);
+	if (result) {
+		return result;
+	}
+	memcpy(b->b_data, data, SFS_BLOCKSIZE);
+	sfs_bdirty(b, SFS_NOINO);
+	sfs_brelse(b);
+	return 0;
+}
+
+#else
+
 int
 sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block)
 {
@@ -105,3 +862,4 @@ sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block)
 	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
 	return sfs_rwblock(sfs, &ku);
 }
+#endif /* OPT_A3 */
@@ -49,10 +49,44 @@
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* Further down */
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
+#if OPT_A3
+static void sfs_vnhashRemove(struct sfs_fs *sfs, struct sfs_vnode *sv);
+#endif
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
 
+/*
+ * Lock a vnode for an operation on it. Without OPT_A3 everything
+ * goes under vfs_biglock.
+ */
+static
+void
+sfs_vnLock(struct sfs_vnode *sv)
+{
+#if OPT_A3
+	lock_acquire(sv->sv_lock);
+#else
+	(void)sv;
+	vfs_biglock_acquire();
+#endif
+}
+
+static
+void
+sfs_vnUnlock(struct sfs_vnode *sv)
+{
+#if OPT_A3
+	lock_release(sv->sv_lock);
+#else
+	(void)sv;
+	vfs_biglock_release();
+#endif
+}
+
 /* Zero out a disk block. */
 static
 int
@@ -70,10 +104,22 @@ sfs_sync_inode(struct sfs_vnode *sv)
 {
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+#if OPT_A3
+		/* Charge the block to the inode so sfs_fsync writes it. */
+		struct sfs_buf *buf;
+		int result = sfs_bget(sfs, sv->sv_ino, &buf);
+		if (result) {
+			return result;
+		}
+		memcpy(sfs_bdata(buf), &sv->sv_i, SFS_BLOCKSIZE);
+		sfs_bdirty(buf, sv->sv_ino);
+		sfs_brelse(buf);
+#else
 		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
 		if (result) {
 			return result;
 		}
+#endif
 		sv->sv_dirty = false;
 	}
 	return 0;
@@ -92,11 +138,22 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 {
 	int result;
 
+#if OPT_A3
+	lock_acquire(sfs->sfs_freemaplock);
 	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
+#else
+	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	if (result) {
+		return result;
+	}
+	sfs->sfs_freemapdirty = true;
+#endif
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
@@ -113,8 +170,14 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+#if OPT_A3
+	lock_acquire(sfs->sfs_freemaplock);
+#endif
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+#if OPT_A3
+	lock_release(sfs->sfs_freemaplock);
+#endif
 }
 
 /*
@@ -124,11 +187,22 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+#if OPT_A3
+	int ret;
+#endif
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
+#if OPT_A3
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
+#else
 	return bitmap_isset(sfs->sfs_freemap, diskblock);
+#endif
 }
 
 ////////////////////////////////////////////////////////////
@@ -146,6 +220,14 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
+#if OPT_A3
+	/* Indirect blocks are worked on in the buffer cache. */
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
+	uint32_t *idblockp;
+	uint32_t off, span;
+	unsigned level;
+#else
 	/*
 	 * I/O buffer for handling indirect blocks.
 	 *
@@ -154,14 +236,22 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 * not use a static area.
 	 */
 	static uint32_t idbuf[SFS_DBPERIDB];
+#endif
 
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	uint32_t block;
 	uint32_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t idoff;
+#if !OPT_A3
+	uint32_t idnum;
+#endif
 	int result;
 
+#if OPT_A3
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+#else
 	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+#endif
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -205,6 +295,90 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 
 	fileblock -= SFS_NDIRECT;
 
+#if OPT_A3
+	/*
+	 * Find which tree the block is in: the single, double, or
+	 * triple indirect block. LEVEL is how many indirect blocks
+	 * deep the data block pointer is, and OFF the block's offset
+	 * within the tree.
+	 */
+	off = fileblock;
+	idblockp = &sv->sv_i.sfi_indirect;
+	span = SFS_DBPERIDB;
+	level = 1;
+	if (off >= span) {
+		off -= span;
+		idblockp = &sv->sv_i.sfi_dindirect;
+		span *= SFS_DBPERIDB;
+		level = 2;
+	}
+	if (level == 2 && off >= span) {
+		off -= span;
+		idblockp = &sv->sv_i.sfi_tindirect;
+		span *= SFS_DBPERIDB;
+		level = 3;
+	}
+	if (off >= span) {
+		/* past the end of the triple indirect block */
+		return EFBIG;
+	}
+
+	idblock = *idblockp;
+	if (idblock==0) {
+		if (!doalloc) {
+			/* Nothing's there; it reads as zeros. */
+			*diskblock = 0;
+			return 0;
+		}
+
+		/*
+		 * Allocate the top indirect block. sfs_balloc zeroes
+		 * it in the cache, so it can be read in below like an
+		 * old one.
+		 */
+		result = sfs_balloc(sfs, &idblock);
+		if (result) {
+			return result;
+		}
+		*idblockp = idblock;
+		sv->sv_dirty = true;
+	}
+
+	/*
+	 * Walk down the tree. At each level, pick the entry covering
+	 * OFF, allocating the block below if it's missing and we're
+	 * asked to. At the bottom the entry is the data block.
+	 */
+	for (block = 0; level > 0; level--) {
+		span /= SFS_DBPERIDB;
+		idoff = off / span;
+		off %= span;
+
+		result = sfs_bread(sfs, idblock, &idbuf);
+		if (result) {
+			return result;
+		}
+		iddata = sfs_bdata(idbuf);
+
+		block = iddata[idoff];
+		if (block==0 && doalloc) {
+			result = sfs_balloc(sfs, &block);
+			if (result) {
+				sfs_brelse(idbuf);
+				return result;
+			}
+			iddata[idoff] = block;
+			sfs_bdirty(idbuf, sv->sv_ino);
+		}
+		sfs_brelse(idbuf);
+
+		if (block==0) {
+			/* a hole */
+			break;
+		}
+		idblock = block;
+	}
+#else
 	/* Get the indirect block number and offset w/i that indirect block */
 	idnum = fileblock / SFS_DBPERIDB;
 	idoff = fileblock % SFS_DBPERIDB;
@@ -229,7 +403,8 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		*diskblock = 0;
 		return 0;
 	}
-	else if (idblock==0) {
+
+	if (idblock==0) {
 		/*
 		 * There's no indirect block allocated, but we need to
 		 * allocate a block whose number needs to be stored in
@@ -280,6 +455,8 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		}
 	}
 
+#endif /* OPT_A3 */
+
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
 		panic("sfs: Data block %u (block %u of file %u) marked free\n",
@@ -308,6 +485,9 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
+#if OPT_A3
+	struct sfs_buf *iobuf;
+#else
 	/*
 	 * I/O buffer for handling partial sectors.
 	 *
@@ -316,6 +496,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	 * not use a static area.
 	 */
 	static char iobuf[SFS_BLOCKSIZE];
+#endif
 
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	uint32_t diskblock;
@@ -336,6 +517,32 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 		return result;
 	}
 
+#if OPT_A3
+	if (diskblock == 0) {
+		/*
+		 * There was no block mapped at this point in the file,
+		 * so it reads as zeros.
+		 */
+		KASSERT(uio->uio_rw == UIO_READ);
+		return uiomovezeros(len, uio);
+	}
+
+	result = sfs_bread(sfs, diskblock, &iobuf);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Now perform the requested operation into/out of the buffer.
+	 * Whatever part of a write got copied in is kept.
+	 */
+	result = uiomove((char *)sfs_bdata(iobuf)+skipstart, len, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		sfs_bdirty(iobuf, sv->sv_ino);
+	}
+	sfs_brelse(iobuf);
+	return result;
+#else
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
@@ -373,6 +580,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	}
 
 	return 0;
+#endif /* OPT_A3 */
 }
 
 /*
@@ -387,10 +595,14 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t fileblock;
 	int result;
 	int doalloc = (uio->uio_rw==UIO_WRITE);
+#if OPT_A3
+	struct sfs_buf *buf;
+#else
 	off_t saveoff;
 	off_t diskoff;
 	off_t saveres;
 	off_t diskres;
+#endif
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -412,6 +624,29 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
+#if OPT_A3
+	/*
+	 * Go through the cache, so a newer copy of the block sitting
+	 * dirty in a buffer is never missed. A whole-block write
+	 * doesn't need the old contents read in.
+	 */
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_bread(sfs, diskblock, &buf);
+	}
+	else {
+		result = sfs_bget(sfs, diskblock, &buf);
+	}
+	if (result) {
+		return result;
+	}
+
+	result = uiomove(sfs_bdata(buf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE && (result == 0 || sfs_bvalid(buf))) {
+		sfs_bdirty(buf, sv->sv_ino);
+	}
+	sfs_brelse(buf);
+	return result;
+#else
 	/*
 	 * Do the I/O directly to the uio region. Save the uio_offset,
 	 * and substitute one that makes sense to the device.
@@ -438,7 +673,75 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
 
 	return result;
+#endif /* OPT_A3 */
+}
+
+#if OPT_A3
+/*
+ * Read-ahead. A read that starts in the block where the last one
+ * left off counts as sequential, and each one doubles the number of
+ * blocks fetched ahead of the reader, up to SFS_RAMAX; any other
+ * read turns it off again. The blocks are read into the buffer
+ * cache in the background, so the reader finds them there.
+ */
+#define SFS_RAMIN 2
+#define SFS_RAMAX 16
+
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t first, off_t endpos)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t blocks[SFS_RAMAX];
+	uint32_t fileblock, stop, fileblocks, diskblock;
+	unsigned n = 0;
+
+	if (first == sv->sv_ranext) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (sv->sv_rawindow < SFS_RAMAX) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_rahigh = 0;
+	}
+	sv->sv_ranext = endpos / SFS_BLOCKSIZE;
+
+	if (sv->sv_rawindow == 0) {
+		return;
+	}
+
+	/* Don't go past EOF, or ask again for blocks already asked for */
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	stop = sv->sv_ranext + sv->sv_rawindow;
+	if (stop > fileblocks) {
+		stop = fileblocks;
+	}
+	fileblock = sv->sv_ranext;
+	if (fileblock < sv->sv_rahigh) {
+		fileblock = sv->sv_rahigh;
+	}
+
+	for (; fileblock < stop; fileblock++) {
+		if (sfs_bmap(sv, fileblock, 0, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			blocks[n++] = diskblock;
+		}
+	}
+	if (fileblock > sv->sv_rahigh) {
+		sv->sv_rahigh = fileblock;
+	}
+
+	if (n > 0) {
+		sfs_breadahead(sfs, blocks, n);
+	}
 }
+#endif /* OPT_A3 */
 
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
@@ -451,6 +754,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t extraresid = 0;
+#if OPT_A3
+	uint32_t firstblock = uio->uio_offset / SFS_BLOCKSIZE;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+#endif
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -534,6 +842,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sv->sv_dirty = true;
 	}
 
+#if OPT_A3
+	/* Start on whatever the reader is likely to want next */
+	if (uio->uio_rw == UIO_READ && result == 0) {
+		sfs_readahead(sv, firstblock, uio->uio_offset);
+	}
+#endif
+
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -610,6 +925,19 @@ sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
 	}
 
+#if OPT_A3
+	/* Keep the name index in step; if we can't, drop it. */
+	if (sv->sv_dirindex != NULL) {
+		sd->sfd_name[sizeof(sd->sfd_name)-1] = 0;
+		result = sfs_dirindex_set(sv->sv_dirindex, slot,
+					  sd->sfd_ino, sd->sfd_name);
+		if (result) {
+			sfs_dirindex_destroy(sv->sv_dirindex);
+			sv->sv_dirindex = NULL;
+		}
+	}
+#endif
+
 	/* Done */
 	return 0;
 }
@@ -642,6 +970,46 @@ sfs_dir_nentries(struct sfs_vnode *sv)
  * empty directory slot if one is found.
  */
 
+#if OPT_A3
+/*
+ * Build the name index for a directory by reading every slot.
+ */
+static
+int
+sfs_dir_loadindex(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di;
+	struct sfs_dir tsd;
+	int nentries = sfs_dir_nentries(sv);
+	int i, result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_dirindex == NULL);
+
+	di = sfs_dirindex_create();
+	if (di == NULL) {
+		return ENOMEM;
+	}
+
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, &tsd, i);
+		if (result) {
+			sfs_dirindex_destroy(di);
+			return result;
+		}
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		result = sfs_dirindex_set(di, i, tsd.sfd_ino, tsd.sfd_name);
+		if (result) {
+			sfs_dirindex_destroy(di);
+			return result;
+		}
+	}
+
+	sv->sv_dirindex = di;
+	return 0;
+}
+#endif
+
 static
 int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
@@ -652,6 +1020,28 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	int nentries = sfs_dir_nentries(sv);
 	int i, result;
 
+#if OPT_A3
+	/*
+	 * Use the name index, building it on first use. If there's no
+	 * memory for it, fall back to searching the directory itself.
+	 */
+	if (sv->sv_dirindex == NULL) {
+		result = sfs_dir_loadindex(sv);
+		if (result && result != ENOMEM) {
+			return result;
+		}
+	}
+	if (sv->sv_dirindex != NULL) {
+		if (emptyslot != NULL) {
+			i = sfs_dirindex_freeslot(sv->sv_dirindex);
+			if (i >= 0) {
+				*emptyslot = i;
+			}
+		}
+		return sfs_dirindex_find(sv->sv_dirindex, name, ino, slot);
+	}
+#endif
+
 	/* For each slot... */
 	for (i=0; i<nentries; i++) {
 
@@ -890,9 +1280,88 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
+#if !OPT_A3
 	unsigned ix, i, num;
+#endif
 	int result;
 
+#if OPT_A3
+	lock_acquire(sv->sv_lock);
+
+	/*
+	 * Write the inode back before taking the vnode table, so the
+	 * table isn't held across the I/O. Nobody can dirty it again
+	 * without sv_lock, so once we're out of the table the copy on
+	 * disk is what the next sfs_loadvnode should see. If there
+	 * are no links it's about to be thrown away anyway.
+	 */
+	if (sv->sv_i.sfi_linkcount > 0) {
+		result = sfs_sync_inode(sv);
+		if (result) {
+			/* if someone picked it up, theirs is the last ref */
+			spinlock_acquire(&v->vn_countlock);
+			if (v->vn_refcount > 1) {
+				v->vn_refcount--;
+			}
+			spinlock_release(&v->vn_countlock);
+			lock_release(sv->sv_lock);
+			return result;
+		}
+	}
+
+	/*
+	 * Make sure someone else hasn't picked up the vnode since the
+	 * decision was made to reclaim it. sfs_loadvnode takes its
+	 * references with the table held shared, so with it held
+	 * exclusive the count can't go up behind our back.
+	 */
+	rwlock_acquire_write(sfs->sfs_vnlock);
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount>1);
+		v->vn_refcount--;
+
+		spinlock_release(&v->vn_countlock);
+		rwlock_release_write(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		return EBUSY;
+	}
+	spinlock_release(&v->vn_countlock);
+
+	/* Remove the vnode structure from the table in the struct sfs_fs. */
+	sfs_vnhashRemove(sfs, sv);
+	sfs->sfs_reclaims++;
+	rwlock_release_write(sfs->sfs_vnlock);
+
+	/*
+	 * If there are no on-disk references to the file either, erase
+	 * it and discard the inode. With no links and no references
+	 * nobody can find it any more, so this needs no table lock.
+	 */
+	result = 0;
+	if (sv->sv_i.sfi_linkcount==0) {
+		result = sfs_dotruncate(sv, 0);
+		if (result == 0) {
+			sfs_bfree(sfs, sv->sv_ino);
+		}
+		sv->sv_dirty = false;
+	}
+
+	lock_release(sv->sv_lock);
+
+	VOP_CLEANUP(&sv->sv_v);
+
+	/* Release the storage for the vnode structure itself. */
+	if (sv->sv_dirindex != NULL) {
+		sfs_dirindex_destroy(sv->sv_dirindex);
+	}
+	lock_destroy(sv->sv_lock);
+	kfree(sv);
+
+	return result;
+#else
 	vfs_biglock_acquire();
 
 	/*
@@ -957,6 +1426,7 @@ sfs_reclaim(struct vnode *v)
 
 	/* Done */
 	return 0;
+#endif /* OPT_A3 */
 }
 
 /*
@@ -971,9 +1441,9 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	sfs_vnLock(sv);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	sfs_vnUnlock(sv);
 
 	return result;
 }
@@ -990,9 +1460,9 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	sfs_vnLock(sv);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	sfs_vnUnlock(sv);
 
 	return result;
 }
@@ -1033,7 +1503,13 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+#if OPT_A3
+	sfs_vnLock(sv);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	sfs_vnUnlock(sv);
+#else
+	statbuf->st_size = sv->sv_i.sfi_size;
+#endif
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +1529,16 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
+	sfs_vnLock(sv);
 
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
+		sfs_vnUnlock(sv);
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
+		sfs_vnUnlock(sv);
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1102,9 +1578,15 @@ sfs_fsync(struct vnode *v)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_vnLock(sv);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+#if OPT_A3
+	/* Push out the inode and the file's blocks from the cache */
+	if (result == 0) {
+		result = sfs_bsync(sv->sv_v.vn_fs->fs_data, sv->sv_ino);
+	}
+#endif
+	sfs_vnUnlock(sv);
 
 	return result;
 }
@@ -1120,13 +1602,102 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 	return EUNIMP;
 }
 
+#if OPT_A3
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Free the blocks mapped by the indirect block *IDBLOCKP that lie at
+ * or past file block BLOCKLEN. BASE is the first file block the
+ * indirect block maps, and LEVEL how deep it is: 1 if its entries
+ * are data blocks, 2 if they're single indirect blocks, and so on.
+ * If nothing is left under it, free it too and zero *IDBLOCKP.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_freeindirect(struct sfs_vnode *sv, uint32_t *idblockp, uint32_t base,
+		 unsigned level, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idb;
+	uint32_t *idbuf;
+	uint32_t span, child, j;
+	unsigned k;
+	bool hasnonzero = false, iddirty = false;
+	int result;
+
+	if (*idblockp == 0) {
+		return 0;
+	}
+
+	/* Number of file blocks each entry covers */
+	for (span = 1, k = 1; k < level; k++) {
+		span *= SFS_DBPERIDB;
+	}
+	if (blocklen >= base + span * SFS_DBPERIDB) {
+		/* all of it is inside the new EOF */
+		return 0;
+	}
+
+	result = sfs_bread(sfs, *idblockp, &idb);
+	if (result) {
+		return result;
+	}
+	idbuf = sfs_bdata(idb);
+
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (idbuf[j] == 0) {
+			continue;
+		}
+		if (level == 1) {
+			/* Discard the block if it's past the new EOF */
+			if (base + j >= blocklen) {
+				sfs_bfree(sfs, idbuf[j]);
+				idbuf[j] = 0;
+				iddirty = true;
+			}
+		}
+		else {
+			child = idbuf[j];
+			result = sfs_freeindirect(sv, &child, base + j*span,
+						  level-1, blocklen);
+			if (result) {
+				if (iddirty) {
+					sfs_bdirty(idb, sv->sv_ino);
+				}
+				sfs_brelse(idb);
+				return result;
+			}
+			if (child != idbuf[j]) {
+				idbuf[j] = child;
+				iddirty = true;
+			}
+		}
+		if (idbuf[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_brelse(idb);
+		sfs_bfree(sfs, *idblockp);
+		*idblockp = 0;
+		return 0;
+	}
+	if (iddirty) {
+		sfs_bdirty(idb, sv->sv_ino);
+	}
+	sfs_brelse(idb);
+	return 0;
+}
+#endif /* OPT_A3 */
+
+/*
+ * Truncate a file to LEN bytes. The caller holds the vnode locked.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
 {
+#if !OPT_A3
 	/*
 	 * I/O buffer for handling the indirect block.
 	 *
@@ -1135,21 +1706,26 @@ sfs_truncate(struct vnode *v, off_t len)
 	 * not use a static area.
 	 */
 	static uint32_t idbuf[SFS_DBPERIDB];
+#endif
 
-	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j, block;
+	uint32_t i, block;
+#if !OPT_A3
+	uint32_t j;
 	uint32_t idblock, baseblock, highblock;
-	int result;
 	int hasnonzero, iddirty;
+#endif
+	int result;
 
+#if OPT_A3
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+#else
 	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
+#endif
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1164,6 +1740,31 @@ sfs_truncate(struct vnode *v, off_t len)
 		}
 	}
 
+#if OPT_A3
+	/*
+	 * Then the single, double, and triple indirect trees. The
+	 * inode is marked dirty below regardless, so any of their
+	 * top blocks being freed gets written back.
+	 */
+	block = SFS_NDIRECT;
+	result = sfs_freeindirect(sv, &sv->sv_i.sfi_indirect, block, 1,
+				  blocklen);
+	if (result) {
+		return result;
+	}
+	block += SFS_DBPERIDB;
+	result = sfs_freeindirect(sv, &sv->sv_i.sfi_dindirect, block, 2,
+				  blocklen);
+	if (result) {
+		return result;
+	}
+	block += SFS_DBPERIDB * SFS_DBPERIDB;
+	result = sfs_freeindirect(sv, &sv->sv_i.sfi_tindirect, block, 3,
+				  blocklen);
+	if (result) {
+		return result;
+	}
+#else
 	/* Indirect block number */
 	idblock = sv->sv_i.sfi_indirect;
 
@@ -1179,7 +1780,6 @@ sfs_truncate(struct vnode *v, off_t len)
 		/* Read the indirect block */
 		result = sfs_rblock(sfs, idbuf, idblock);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 		
@@ -1208,11 +1808,11 @@ sfs_truncate(struct vnode *v, off_t len)
 			/* The indirect block is dirty; write it back */
 			result = sfs_wblock(sfs, idbuf, idblock);
 			if (result) {
-				vfs_biglock_release();
 				return result;
 			}
 		}
 	}
+#endif /* OPT_A3 */
 
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
@@ -1220,10 +1820,26 @@ sfs_truncate(struct vnode *v, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	sfs_vnLock(sv);
+	result = sfs_dotruncate(sv, len);
+	sfs_vnUnlock(sv);
+
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1259,18 +1875,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_vnLock(sv);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		sfs_vnUnlock(sv);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		sfs_vnUnlock(sv);
 		return EEXIST;
 	}
 
@@ -1278,18 +1894,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			sfs_vnUnlock(sv);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		sfs_vnUnlock(sv);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		sfs_vnUnlock(sv);
 		return result;
 	}
 
@@ -1300,19 +1916,25 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
+		sfs_vnUnlock(sv);
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+#if OPT_A3
+	sfs_vnLock(newguy);
+#endif
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+#if OPT_A3
+	sfs_vnUnlock(newguy);
+#endif
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	sfs_vnUnlock(sv);
 	return 0;
 }
 
@@ -1331,20 +1953,26 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	sfs_vnLock(sv);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		sfs_vnUnlock(sv);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+#if OPT_A3
+	sfs_vnLock(f);
+#endif
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+#if OPT_A3
+	sfs_vnUnlock(f);
+#endif
 
-	vfs_biglock_release();
+	sfs_vnUnlock(sv);
 	return 0;
 }
 
@@ -1360,12 +1988,12 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_vnLock(sv);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		sfs_vnUnlock(sv);
 		return result;
 	}
 
@@ -1373,15 +2001,29 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+#if OPT_A3
+		sfs_vnLock(victim);
+#endif
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+#if OPT_A3
+		sfs_vnUnlock(victim);
+#endif
 	}
 
+#if OPT_A3
+	/* reclaiming the victim doesn't need the directory */
+	sfs_vnUnlock(sv);
+
+	/* Discard the reference that sfs_lookonce got us */
+	VOP_DECREF(&victim->sv_v);
+#else
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
+	sfs_vnUnlock(sv);
+#endif
 	return result;
 }
 
@@ -1401,7 +2043,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
+	sfs_vnLock(sv);
 
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
@@ -1409,7 +2051,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		sfs_vnUnlock(sv);
 		return result;
 	}
 
@@ -1430,8 +2072,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+#if OPT_A3
+	sfs_vnLock(g1);
+	g1->sv_i.sfi_linkcount++;
+	g1->sv_dirty = true;
+	sfs_vnUnlock(g1);
+#else
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+#endif
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1443,14 +2092,22 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+#if OPT_A3
+	sfs_vnLock(g1);
+	KASSERT(g1->sv_i.sfi_linkcount>0);
+	g1->sv_i.sfi_linkcount--;
+	g1->sv_dirty = true;
+	sfs_vnUnlock(g1);
+#else
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+#endif
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
+	sfs_vnUnlock(sv);
 	return 0;
 
  puke_harder:
@@ -1464,11 +2121,17 @@ sfs_rename(struct vnode *d1, const char *n1,
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+#if OPT_A3
+	sfs_vnLock(g1);
+	g1->sv_i.sfi_linkcount--;
+	sfs_vnUnlock(g1);
+#else
 	g1->sv_i.sfi_linkcount--;
+#endif
  puke:
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
+	sfs_vnUnlock(sv);
 	return result;
 }
 
@@ -1486,15 +2149,15 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
+	sfs_vnLock(sv);
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
+		sfs_vnUnlock(sv);
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
+		sfs_vnUnlock(sv);
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2165,7 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
+	sfs_vnUnlock(sv);
 	return 0;
 }
 
@@ -1520,22 +2183,22 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_vnLock(sv);
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
+		sfs_vnUnlock(sv);
 		return ENOTDIR;
 	}
 	
 	result = sfs_lookonce(sv, path, &final, NULL);
 	if (result) {
-		vfs_biglock_release();
+		sfs_vnUnlock(sv);
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
+	sfs_vnUnlock(sv);
 	return 0;
 }
 
@@ -1642,6 +2305,92 @@ static const struct vnode_ops sfs_dirops = {
 	sfs_lookparent,
 };
 
+#if OPT_A3
+/*
+ * Find inode INO in the vnodes table, or return NULL. The caller must
+ * hold sfs_vnlock, shared or exclusive.
+ */
+static
+struct sfs_vnode *
+sfs_findvnode(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	for (sv = sfs->sfs_vnhash[ino % SFS_VNHASH]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+
+		/*
+		 * Every inode in memory must be in an allocated block.
+		 * Checking takes the freemap lock, so only do it when
+		 * debugging sfs.
+		 */
+		if ((dbflags & DB_SFS) && !sfs_bused(sfs, sv->sv_ino)) {
+			panic("sfs: Found inode %u in unallocated block\n",
+			      sv->sv_ino);
+		}
+
+		if (sv->sv_ino==ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add SV to the vnodes table. The caller must hold sfs_vnlock
+ * exclusive.
+ */
+static
+int
+sfs_vnhashAdd(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h = sv->sv_ino % SFS_VNHASH;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sfs->sfs_vnlock));
+
+	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, &sv->sv_vnix);
+	if (result) {
+		return result;
+	}
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+	return 0;
+}
+
+/*
+ * Take SV out of the vnodes table. The last vnode in sfs_vnodes moves
+ * into its place, so this doesn't depend on how many are loaded. The
+ * caller must hold sfs_vnlock exclusive.
+ */
+static
+void
+sfs_vnhashRemove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp, *last;
+	unsigned num;
+
+	KASSERT(rwlock_do_i_hold_write(sfs->sfs_vnlock));
+
+	for (pp = &sfs->sfs_vnhash[sv->sv_ino % SFS_VNHASH]; *pp != sv;
+	     pp = &(*pp)->sv_hashnext) {
+		if (*pp == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
+		}
+	}
+	*pp = sv->sv_hashnext;
+
+	num = vnodearray_num(sfs->sfs_vnodes);
+	KASSERT(sv->sv_vnix < num);
+	KASSERT(vnodearray_get(sfs->sfs_vnodes, sv->sv_vnix) == &sv->sv_v);
+	last = vnodearray_get(sfs->sfs_vnodes, num-1)->vn_data;
+	vnodearray_set(sfs->sfs_vnodes, sv->sv_vnix, &last->sv_v);
+	last->sv_vnix = sv->sv_vnix;
+	vnodearray_setsize(sfs->sfs_vnodes, num-1);
+}
+#endif
+
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
@@ -1651,12 +2400,33 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
-	const struct vnode_ops *ops = NULL;
+#if OPT_A3
+	struct sfs_vnode *other;
+	unsigned reclaims;
+#else
+	struct vnode *v;
 	unsigned i, num;
+#endif
+	const struct vnode_ops *ops = NULL;
 	int result;
 
+#if OPT_A3
+ retry:
+	rwlock_acquire_read(sfs->sfs_vnlock);
+	reclaims = sfs->sfs_reclaims;
+	sv = sfs_findvnode(sfs, ino);
+	if (sv != NULL) {
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+
+		VOP_INCREF(&sv->sv_v);
+		rwlock_release_read(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
+	}
+	rwlock_release_read(sfs->sfs_vnlock);
+#else
 	/* Look in the vnodes table */
 	num = vnodearray_num(sfs->sfs_vnodes);
 
@@ -1682,6 +2452,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 			return 0;
 		}
 	}
+#endif
 
 	/* Didn't have it loaded; load it */
 
@@ -1742,9 +2513,55 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+#if OPT_A3
+	sv->sv_ranext = 0;
+	sv->sv_rahigh = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_dirindex = NULL;
+#endif
 
 	/* Add it to our table */
+#if OPT_A3
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		VOP_CLEANUP(&sv->sv_v);
+		kfree(sv);
+		return ENOMEM;
+	}
+
+	/*
+	 * The table wasn't held while we read the inode, so someone
+	 * may have loaded it in the meantime. If so, use theirs. If
+	 * it was loaded and reclaimed in the meantime, what we read
+	 * may predate what the reclaim wrote back, so read it again.
+	 */
+	rwlock_acquire_write(sfs->sfs_vnlock);
+	other = sfs_findvnode(sfs, ino);
+	if (other != NULL) {
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+		VOP_INCREF(&other->sv_v);
+		rwlock_release_write(sfs->sfs_vnlock);
+		VOP_CLEANUP(&sv->sv_v);
+		lock_destroy(sv->sv_lock);
+		kfree(sv);
+		*ret = other;
+		return 0;
+	}
+	if (forcetype == SFS_TYPE_INVAL && sfs->sfs_reclaims != reclaims) {
+		rwlock_release_write(sfs->sfs_vnlock);
+		VOP_CLEANUP(&sv->sv_v);
+		lock_destroy(sv->sv_lock);
+		kfree(sv);
+		goto retry;
+	}
+	result = sfs_vnhashAdd(sfs, sv);
+	rwlock_release_write(sfs->sfs_vnlock);
+	if (result) {
+		lock_destroy(sv->sv_lock);
+	}
+#else
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
+#endif
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
 		kfree(sv);
@@ -1767,14 +2584,18 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
+#if !OPT_A3
 	vfs_biglock_acquire();
+#endif
 
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
+#if !OPT_A3
 	vfs_biglock_release();
+#endif
 
 	return &sv->sv_v;
 }
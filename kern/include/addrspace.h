@@ -48,7 +48,57 @@ struct vnode;
  * You write this.
  */
 
+#if OPT_A3
+/*
+ * Page table entries. A present entry holds the physical frame in its
+ * upper bits and PTE_VALID in its low bits. An entry of 0 means the
+ * page hasn't been touched yet; vm_fault fills it in on first use.
+ *
+ * PTE_COW marks a writeable page whose frame may be shared with other
+ * address spaces since a fork. It is mapped read-only, and the first
+ * write gives this address space its own copy.
+ *
+ * A page that has been paged out has PTE_VALID clear, PTE_SWAPPED set
+ * and its swap slot in the upper bits instead of a frame.
+ */
+#define PTE_VALID   0x00000001
+#define PTE_COW     0x00000002
+#define PTE_SWAPPED 0x00000004
+#define PTE_FRAME PAGE_FRAME
+#define PTE_SLOT(pte)     ((pte) >> 12)
+#define PTE_MKSWAP(slot)  (((slot) << 12) | PTE_SWAPPED)
+
+/*
+ * A region of the address space (text, data or stack).
+ *
+ * Pages that overlap [r_filevaddr, r_filevaddr + r_filesize) are read
+ * from the executable (as_vnode) at file offset r_offset when first
+ * touched; all other pages of the region are zero-filled.
+ */
+struct region {
+  vaddr_t r_vbase;
+  size_t r_npages;
+  bool r_writeable;
+  uint32_t *r_pt;      /* one entry per page */
+  vaddr_t r_filevaddr;
+  off_t r_offset;
+  size_t r_filesize;
+};
+
+#define AS_NREGIONS 3  /* two ELF segments plus the stack */
+#define AS_STACK    (AS_NREGIONS - 1)
+#endif
+
 struct addrspace {
+#if OPT_A3
+  struct lock *as_lock;    /* protects the page tables */
+  struct region as_regions[AS_NREGIONS];
+  struct vnode *as_vnode;  /* executable backing the regions, or NULL */
+  bool as_isLoadElfComplete;
+  uint32_t as_asid;        /* TLB address space ID, valid while as_asidGen is current */
+  uint32_t as_asidGen;
+  uint32_t as_tlbCpus;     /* cpus that may hold its TLB entries, under any ID */
+#else
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
   size_t as_npages1;
@@ -56,9 +106,7 @@ struct addrspace {
   paddr_t as_pbase2;
   size_t as_npages2;
   paddr_t as_stackpbase;
-  #if OPT_A3
-    bool as_isLoadElfComplete;
-  #endif
+#endif
 };
 
 /*
@@ -95,6 +143,10 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_backing - record that part of a region is backed by the
+ *                executable V, so its pages can be read in on demand
+ *                instead of at load time.
  */
 
 struct addrspace *as_create(void);
@@ -111,6 +163,11 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if OPT_A3
+int               as_define_backing(struct addrspace *as, struct vnode *v,
+                                    off_t offset, vaddr_t vaddr,
+                                    size_t filesize);
+#endif
 
 
 /*
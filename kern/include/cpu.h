@@ -34,6 +34,17 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include "opt-A3.h"
+
+#if OPT_A3
+/*
+ * Size of the per-cpu cache of free single frames kept in front of
+ * the coremap, and how many frames move to or from the coremap at
+ * once when it runs empty or full.
+ */
+#define CPU_PAGECACHE_SIZE	32
+#define CPU_PAGECACHE_BATCH	16
+#endif
 
 
 /*
@@ -60,6 +71,17 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+#if OPT_A3
+	/* Hot single frames (coremap indices); use with interrupts off */
+	int c_pagecache[CPU_PAGECACHE_SIZE];
+	unsigned c_pagecache_count;
+	/* Current address space ID and the ID generation our TLB is clean for */
+	uint32_t c_asid;
+	uint32_t c_asidgen;
+	/* Next TLB slot to replace; slots from there on are free if c_tlbfree */
+	unsigned c_tlbhand;
+	unsigned c_tlbfree;
+#endif
 
 	/*
 	 * Accessed by other cpus.
@@ -152,6 +174,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends a shootdown to the CPUs whose bits
+ * (1 << c_number) are set in CPUS, except the current one, and returns
+ * how many were sent.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +191,10 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+#if OPT_A3
+unsigned ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping,
+				    uint32_t cpus);
+#endif
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,56 @@
+#ifndef _FILE_H_
+#define _FILE_H_
+
+/*
+ * Open files and per-process file descriptor tables.
+ *
+ * An open file is what open() creates: a vnode, the flags it was
+ * opened with, and a seek offset. Descriptors made by dup2() or
+ * inherited through fork() share the open file, and with it the
+ * offset, so open files are reference counted. Each has its own lock
+ * for the offset, so I/O on one open file never waits for another.
+ *
+ * A process's descriptor table maps descriptors to open files. Its
+ * spinlock only covers looking an entry up or changing it; the I/O
+ * itself happens with a reference on the open file and no table lock.
+ *
+ *    file_bootstrap  - set up the allocator for open files.
+ *    fdtable_create  - a new table with the console open on 0, 1 and 2,
+ *                 for a program started from the menu. NULL if out of
+ *                 memory.
+ *    fdtable_copy    - a table sharing every open file of FT, for fork.
+ *                 NULL if out of memory.
+ *    fdtable_destroy - close everything in the table and free it.
+ */
+
+#include <spinlock.h>
+#include <limits.h>
+#include "opt-A3.h"
+
+#if OPT_A3
+
+struct vnode;
+struct lock;
+
+struct openfile {
+	struct vnode *of_vn;
+	int of_flags;                   /* flags passed to open */
+	off_t of_offset;                /* shared by all fds for this file */
+	struct lock *of_lock;           /* protects of_offset */
+	unsigned of_refcount;           /* fds referring to it, all procs */
+	struct spinlock of_countlock;
+};
+
+struct fdtable {
+	struct spinlock ft_lock;        /* protects ft_files */
+	struct openfile *ft_files[OPEN_MAX];
+};
+
+void file_bootstrap(void);
+struct fdtable *fdtable_create(void);
+struct fdtable *fdtable_copy(struct fdtable *ft);
+void fdtable_destroy(struct fdtable *ft);
+
+#endif /* OPT_A3 */
+
+#endif /* _FILE_H_ */
@@ -76,14 +76,25 @@ struct sfs_super {
 
 /*
  * On-disk inode
+ *
+ * After the direct blocks come a single, a double, and a triple
+ * indirect block, mapping SFS_DBPERIDB, SFS_DBPERIDB^2, and
+ * SFS_DBPERIDB^3 more blocks respectively. The double and triple
+ * indirect blocks took over words of sfi_waste, which is always
+ * zero, so older volumes read as having neither.
  */
+#define HAS_DIDIRECT                    /* sfi_dindirect exists */
+#define HAS_TIDIRECT                    /* sfi_tindirect exists */
+
 struct sfs_inode {
 	uint32_t sfi_size;			/* Size of this file (bytes) */
 	uint16_t sfi_type;			/* One of SFS_TYPE_* above */
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_waste[128-5-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
 /*
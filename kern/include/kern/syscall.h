@@ -93,6 +93,7 @@
 //                              (process priority control)
 //#define SYS_getpriority 38
 //#define SYS_setpriority 39
+#define SYS_nice         121
 //                              (process groups, sessions, and job control)
 //#define SYS_getpgid    40
 //#define SYS_setpgid    41
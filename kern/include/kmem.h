@@ -0,0 +1,32 @@
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/*
+ * Object caches for frequently allocated kernel structures.
+ *
+ * A cache hands out objects of one exact size, carved out of whole
+ * pages (slabs) that hold nothing else, so there is no rounding to a
+ * kmalloc size class and no shared heap lock. Freed objects are kept
+ * in a small per-cpu magazine first, so an alloc that follows a free
+ * on the same cpu touches no shared state at all.
+ *
+ * The constructor, if given, runs once when an object is first carved
+ * out of a slab, not on every allocation. Objects have to be back in
+ * their constructed state when they are freed.
+ *
+ *    kmem_cache_create - make a cache for objects of SIZE bytes (at
+ *                 most KMEM_MAXSIZE). Returns NULL if out of memory.
+ *    kmem_cache_alloc  - get an object, or NULL if out of memory.
+ *    kmem_cache_free   - give an object back to the cache it came from.
+ */
+
+#define KMEM_MAXSIZE 2048
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+#endif /* _KMEM_H_ */
@@ -0,0 +1,30 @@
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+/*
+ * Pipes.
+ *
+ * A pipe is a PIPE_SIZE ring buffer with a vnode for each end. Reading
+ * the read end blocks while the buffer is empty and returns 0 once it
+ * is empty and the write end is gone; writing blocks while the buffer
+ * is full and fails with EPIPE once the read end is gone. An end goes
+ * away when its vnode is reclaimed.
+ *
+ *    pipe_create - make a pipe and hand back its two ends, each with
+ *                 one reference and opened once (so vfs_close undoes
+ *                 it). Returns ENOMEM if out of memory.
+ */
+
+#include "opt-A3.h"
+
+#if OPT_A3
+
+#define PIPE_SIZE PAGE_SIZE     /* must be a power of 2 */
+
+struct vnode;
+
+int pipe_create(struct vnode **readend, struct vnode **writeend);
+
+#endif /* OPT_A3 */
+
+#endif /* _PIPE_H_ */
@@ -39,6 +39,7 @@
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 //new changes
 #if OPT_A2
@@ -49,6 +50,9 @@
 
 struct addrspace;
 struct vnode;
+#if OPT_A3
+struct fdtable;
+#endif
 #ifdef UW
 struct semaphore;
 #endif // UW
@@ -66,6 +70,9 @@ struct proc {
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
+#if OPT_A3
+	struct fdtable *p_fdtable;	/* open file descriptors */
+#endif
 
 #ifdef UW
   /* a vnode to refer to the console device */
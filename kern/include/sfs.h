@@ -47,24 +47,61 @@
  * userland for the benefit of mksfs, dumpsfs, etc.
  */
 #include <kern/sfs.h>
+#include "opt-A3.h"
 
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+#if OPT_A3
+	struct lock *sv_lock;           /* protects sv_i, sv_dirty, data */
+	uint32_t sv_ranext;             /* where a sequential read goes on */
+	uint32_t sv_rahigh;             /* read ahead up to here */
+	unsigned sv_rawindow;           /* blocks to read ahead; 0 if off */
+	struct sfs_dirindex *sv_dirindex; /* name index; NULL if not built */
+	struct sfs_vnode *sv_hashnext;  /* sfs_vnhash chain */
+	unsigned sv_vnix;               /* where it is in sfs_vnodes */
+#endif
 };
 
+#if OPT_A3
+#define SFS_VNHASH 64                   /* buckets in sfs_vnhash */
+#endif
+
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+#if OPT_A3
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASH]; /* sfs_vnodes by inode */
+	struct rwlock *sfs_vnlock;      /* protects sfs_vnodes, sfs_vnhash */
+	unsigned sfs_reclaims;          /* vnodes dropped from sfs_vnodes */
+#endif
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+#if OPT_A3
+	struct lock *sfs_freemaplock;   /* protects the above and superdirty */
+#endif
 };
 
+#if OPT_A3
+/*
+ * SFS locking, in the order locks are taken:
+ *
+ *    sv_lock of a directory
+ *    sv_lock of a file in it
+ *    sfs_vnlock
+ *    sfs_freemaplock
+ *
+ * Each vnode op takes the sv_lock of the vnode(s) it works on, so
+ * I/O to different files proceeds in parallel. vfs_biglock is only
+ * taken by mount and unmount, through the VFS layer.
+ */
+#endif
+
 /*
  * Function for mounting a sfs (calls vfs_mount)
  */
@@ -84,6 +121,42 @@ int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+#if OPT_A3
+/*
+ * Buffer cache, shared by all mounted sfs volumes. sfs_bget and
+ * sfs_bread hand back a buffer the caller has to itself until
+ * sfs_brelse; sfs_bget doesn't read the block in, for callers about
+ * to overwrite all of it. Modified buffers are marked with
+ * sfs_bdirty and written back by sfs_bsync, or when recycled.
+ * sfs_breadahead queues blocks to be read in by a background thread.
+ */
+struct sfs_buf;
+
+void sfs_bbootstrap(void);
+int sfs_bget(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+int sfs_bread(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+void sfs_breadahead(struct sfs_fs *sfs, const uint32_t *blocks, unsigned n);
+void *sfs_bdata(struct sfs_buf *buf);
+bool sfs_bvalid(struct sfs_buf *buf);
+void sfs_bdirty(struct sfs_buf *buf, uint32_t owner);
+void sfs_brelse(struct sfs_buf *buf);
+int sfs_bsync(struct sfs_fs *sfs, uint32_t owner);
+void sfs_binvalidate(struct sfs_fs *sfs);
+void sfs_bstats(void);
+
+/*
+ * In-memory index of a directory's names and free slots (see
+ * sfs_dirindex.c). The caller holds the directory's sv_lock.
+ */
+struct sfs_dirindex *sfs_dirindex_create(void);
+void sfs_dirindex_destroy(struct sfs_dirindex *di);
+int sfs_dirindex_set(struct sfs_dirindex *di, int slot, uint32_t ino,
+		     const char *name);
+int sfs_dirindex_find(struct sfs_dirindex *di, const char *name,
+		      uint32_t *ino, int *slot);
+int sfs_dirindex_freeslot(struct sfs_dirindex *di);
+#endif
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
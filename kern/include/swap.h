@@ -0,0 +1,33 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space for the VM system.
+ *
+ * Pages are swapped out to a raw disk device (SWAP_DEVICE) one page per
+ * slot. Slots are reference counted so that an address space and its
+ * forked copies can share a swapped-out page; the page is read into a
+ * private frame by whoever touches it first.
+ *
+ *    swap_bootstrap - open the swap device. If it does not exist the
+ *                 VM system simply runs without swap.
+ *    swap_enabled - true if swap_bootstrap found a swap device.
+ *    swap_alloc   - grab a free slot (with one reference) for a page.
+ *                 Returns ENOSPC if the swap device is full.
+ *    swap_incref  - add a reference to a slot.
+ *    swap_decref  - drop a reference, freeing the slot on the last one.
+ *    swap_pageout - write the frame at PADDR to SLOT.
+ *    swap_pagein  - read SLOT into the frame at PADDR.
+ */
+
+#define SWAP_DEVICE "lhd1raw:"
+
+void swap_bootstrap(void);
+bool swap_enabled(void);
+int  swap_alloc(unsigned *slot);
+void swap_incref(unsigned slot);
+void swap_decref(unsigned slot);
+int  swap_pageout(paddr_t paddr, unsigned slot);
+int  swap_pagein(paddr_t paddr, unsigned slot);
+
+#endif /* _SWAP_H_ */
@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include "opt-A3.h"
 
 /*
  * Dijkstra-style semaphore.
@@ -71,12 +72,20 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * With OPT_A3 the lock is adaptive: a thread that finds it held spins
+ * for a while if the owner is running on another cpu, and sleeps
+ * otherwise. A release with sleepers hands the lock straight to the
+ * one it wakes, so nobody can barge in ahead of it.
  */
 struct lock {
         char *lk_name;
         struct wchan *lock_wchan;
-        struct thread *owner;
+        struct thread *volatile owner;
         struct spinlock lock_lock;
+#if OPT_A3
+        unsigned lk_sleepers;   /* threads asleep on lock_wchan */
+#endif
         // (don't forget to mark things volatile as needed)
 };
 
@@ -90,12 +99,15 @@ void lock_acquire(struct lock *);
  *                   same time.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
+ *    lock_tryacquire - Get the lock if nobody holds it and return true;
+ *                   otherwise return false right away without sleeping.
  *    lock_do_i_hold - Return true if the current thread holds the lock; 
  *                   false otherwise.
  *
  * These operations must be atomic. You get to write them.
  */
 void lock_release(struct lock *);
+bool lock_tryacquire(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
@@ -141,5 +153,65 @@ void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
+#if OPT_A3
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers queue
+ * up behind it instead of joining the readers already inside. So
+ * that a steady stream of writers can't starve readers, waiting
+ * readers are let in after RWLOCK_WRITER_BATCH writers have gone
+ * ahead of them.
+ *
+ * Like struct lock, the lock is handed directly to the threads a
+ * release wakes, so nobody can slip in between the wakeup and the
+ * woken thread running.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+#define RWLOCK_WRITER_BATCH 4
+
+struct rwlock {
+        char *rwlock_name;
+        struct spinlock rw_lock;
+        struct wchan *rw_readwchan;     // readers waiting
+        struct wchan *rw_writewchan;    // writers waiting
+        unsigned rw_readers;            // readers inside
+        struct thread *rw_writer;       // writer inside, if any
+        unsigned rw_waitreaders;
+        unsigned rw_waitwriters;
+        unsigned rw_writebatch;         // writers let past waiting readers
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock shared with other readers.
+ *    rwlock_release_read  - Drop a shared hold.
+ *    rwlock_acquire_write - Get the lock exclusively.
+ *    rwlock_release_write - Drop an exclusive hold. Only the thread
+ *                           holding the lock may do this.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing.
+ *
+ * None of these may be called from an interrupt handler.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+/*
+ * Set up the object cache locks are allocated from. Must be called
+ * before the first lock_create.
+ */
+void synch_bootstrap(void);
+#endif
+
 
 #endif /* _SYNCH_H_ */
@@ -28,6 +28,7 @@
  */
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 #ifndef _SYSCALL_H_
 #define _SYSCALL_H_
@@ -50,6 +51,15 @@ void syscall(struct trapframe *tf);
 	void enter_forked_process(void *data1, unsigned long data2);
 #endif //OPT_A2
 
+#if OPT_A3
+/*
+ * Trapframe copies handed from fork() to enter_forked_process come
+ * from this cache, which trapframe_bootstrap sets up.
+ */
+extern struct kmem_cache *trapframe_cache;
+void trapframe_bootstrap(void);
+#endif //OPT_A3
+
 /* Enter user mode. Does not return. */
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
@@ -69,9 +79,22 @@ int sys_getpid(pid_t *retval);
 #if OPT_A2
 	int sys_fork(struct trapframe *tf, pid_t *retval);
 	int sys_execv(userptr_t prognam, userptr_t args);
+#if OPT_A3
+	int copyArgs(vaddr_t *stackptr, char **kernelArgs, int count);
+#else
 	void copyArgs(vaddr_t *stackptr, char **kernelArgs, int count);
+#endif //OPT_A3
 #endif //OPT_A2
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
+#if OPT_A3
+	int sys_nice(int incr, int *retval);
+	int sys_open(userptr_t path, int flags, mode_t mode, int *retval);
+	int sys_read(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval);
+	int sys_close(int fdesc);
+	int sys_lseek(int fdesc, off_t pos, int whence, off_t *retval);
+	int sys_dup2(int oldfd, int newfd, int *retval);
+	int sys_pipe(userptr_t fds, int *retval);
+#endif //OPT_A3
 
 #endif // UW
 
@@ -28,6 +28,7 @@
  */
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 #ifndef _TEST_H_
 #define _TEST_H_
@@ -62,6 +63,9 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+#if OPT_A3
+int rwtest(int, char **);
+#endif
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -39,6 +39,7 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include "opt-A3.h"
 
 struct cpu;
 
@@ -55,6 +56,15 @@ struct cpu;
 /* Macro to test if two addresses are on the same kernel stack */
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
+#if OPT_A3
+/*
+ * Scheduling levels. 0 runs first; a thread that uses up its whole
+ * quantum drops a level, and the quantum doubles with each level.
+ */
+#define THREAD_NPRIO 4
+#define THREAD_QUANTUM(prio) (1 << (prio))	/* in hardclocks */
+#endif
+
 
 /* States a thread can be in. */
 typedef enum {
@@ -101,6 +111,17 @@ struct thread {
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
+#if OPT_A3
+	/*
+	 * Scheduling fields. Changed with the thread's run queue locked,
+	 * by the thread itself with interrupts off, or by whoever wakes it.
+	 */
+	int t_priority;			/* Current level, see THREAD_NPRIO */
+	int t_basepriority;		/* Best level allowed (set by nice) */
+	int t_quantum;			/* Hardclocks left at this level */
+	unsigned t_lastrun;		/* t_cpu's c_hardclocks when it last ran */
+#endif
+
 	/*
 	 * Public fields
 	 */
@@ -162,11 +183,28 @@ void thread_yield(void);
  */
 void schedule(void);
 
+#if !OPT_A3
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * timer interrupt. (With OPT_A3, idle CPUs steal work instead.)
  */
 void thread_consider_migration(void);
+#endif
+
+#if OPT_A3
+/*
+ * Charge the current thread for one hardclock. Returns true if it
+ * should give up the cpu: it used up its quantum or a better thread is
+ * waiting. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
+/*
+ * Add INCR to the current thread's base level, keeping it in range.
+ * Returns the new base level.
+ */
+int thread_nice(int incr);
+#endif
 
 
 #endif /* _THREAD_H_ */
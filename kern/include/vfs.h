@@ -32,6 +32,7 @@
 
 
 #include <array.h>
+#include "opt-A3.h"
 
 
 /*
@@ -81,6 +82,24 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+#if OPT_A3
+/*
+ * Name lookup cache used by vfs_lookup (see vfslookup.c).
+ *
+ *    vfs_dcache_bootstrap      - Set up the cache. Called by vfs_bootstrap.
+ *    vfs_dcache_purge          - Forget every lookup on filesystem FS, or
+ *                                on all filesystems if FS is NULL. Must
+ *                                be called after removing or renaming
+ *                                anything, and before unmounting.
+ *    vfs_dcache_purgenegative  - Forget the names on FS that were not
+ *                                found. Must be called after creating
+ *                                anything.
+ */
+void vfs_dcache_bootstrap(void);
+void vfs_dcache_purge(struct fs *fs);
+void vfs_dcache_purgenegative(struct fs *fs);
+#endif
+
 /*
  * VFS layer high-level operations on pathnames
  * Because namei may destroy pathnames, these all may too.
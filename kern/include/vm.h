@@ -38,6 +38,7 @@
 
 
 #include <machine/vm.h>
+#include "opt-A3.h"
 
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
@@ -55,6 +56,15 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+#if OPT_A3
+/* Print per-order free block counts of the physical page allocator */
+void coremap_printstats(void);
+
+/* Zero or copy one whole page-aligned physical frame */
+void page_zero(paddr_t paddr);
+void page_copy(paddr_t dst, paddr_t src);
+#endif
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
@@ -30,6 +30,8 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
+#include "opt-A3.h"
 
 struct uio;
 struct stat;
@@ -50,10 +52,19 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * With OPT_A3 both counts are protected by vn_countlock. When the
+ * last reference goes, VOP_RECLAIM is called without it held, so
+ * the filesystem must recheck vn_refcount (under vn_countlock) in
+ * whatever lock it uses to find vnodes, and drop the extra reference
+ * and return EBUSY if the vnode was picked up again in between.
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
+#if OPT_A3
+	struct spinlock vn_countlock;   /* Lock for the counts */
+#endif
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -51,12 +51,27 @@
 #include <synch.h>
 #include <kern/fcntl.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <kmem.h>
+#include <file.h>
+#endif
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+#if OPT_A3
+/* proc structures come from here, see proc_bootstrap */
+static struct kmem_cache *proc_cache;
+#define PROC_ALLOC() kmem_cache_alloc(proc_cache)
+#define PROC_FREE(proc) kmem_cache_free(proc_cache, (proc))
+#else
+#define PROC_ALLOC() kmalloc(sizeof(struct proc))
+#define PROC_FREE(proc) kfree(proc)
+#endif
+
 /*
  * Mechanism for making the kernel menu thread sleep while processes are running
  */
@@ -79,13 +94,13 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = PROC_ALLOC();
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		PROC_FREE(proc);
 		return NULL;
 	}
 
@@ -97,6 +112,9 @@ proc_create(const char *name)
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
+#if OPT_A3
+	proc->p_fdtable = NULL;
+#endif
 
 #ifdef UW
 	proc->console = NULL;
@@ -126,14 +144,14 @@ proc_create(const char *name)
 	proc->conditionLock = lock_create("conditionLock");
 	if (proc->conditionLock == NULL) {
 		kfree(proc->p_name);
-		kfree(proc);
+		PROC_FREE(proc);
 		return NULL;
 	}
 	proc->waitCondition = cv_create("waitCondition");
 	if (proc->waitCondition == NULL) {
-		kfree(proc->conditionLock);
+		lock_destroy(proc->conditionLock);
 		kfree(proc->p_name);
-		kfree(proc);
+		PROC_FREE(proc);
 		return NULL;
 	}
 #endif /* OPT_A2 */
@@ -170,6 +188,13 @@ proc_destroy(struct proc *proc)
 		VOP_DECREF(proc->p_cwd);
 		proc->p_cwd = NULL;
 	}
+#if OPT_A3
+	/* normally closed already by sys__exit */
+	if (proc->p_fdtable) {
+		fdtable_destroy(proc->p_fdtable);
+		proc->p_fdtable = NULL;
+	}
+#endif
 
 
 #ifndef UW  // in the UW version, space destruction occurs in sys_exit, not here
@@ -236,7 +261,7 @@ proc_destroy(struct proc *proc)
 	spinlock_cleanup(&proc->p_lock);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	PROC_FREE(proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -261,6 +286,12 @@ proc_destroy(struct proc *proc)
  */
 void
 proc_bootstrap(void) {
+#if OPT_A3
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc), NULL);
+	if (proc_cache == NULL) {
+		panic("proc_bootstrap: Out of memory\n");
+	}
+#endif
 	//new changes
 	#if OPT_A2
 		cPid = 1;
@@ -303,14 +334,16 @@ struct proc *
 proc_create_runprogram(const char *name)
 {
 	struct proc *proc;
+#if !OPT_A3
 	char *console_path;
+#endif
 
 	proc = proc_create(name);
 	if (proc == NULL) {
 		return NULL;
 	}
 
-#ifdef UW
+#if defined(UW) && !OPT_A3
 	/* open the console - this should always succeed */
 	console_path = kstrdup("con:");
 	if (console_path == NULL) {
@@ -354,6 +387,25 @@ proc_create_runprogram(const char *name)
 	V(proc_count_mutex);
 #endif // UW
 
+#if OPT_A3
+	/*
+	 * File descriptors: a forked child shares its parent's open
+	 * files; a program started from the menu (curproc is kproc,
+	 * which has none) gets the console on 0, 1 and 2. Done last so
+	 * proc_destroy can clean up if it fails.
+	 */
+	if (curproc->p_fdtable != NULL) {
+		proc->p_fdtable = fdtable_copy(curproc->p_fdtable);
+	}
+	else {
+		proc->p_fdtable = fdtable_create();
+	}
+	if (proc->p_fdtable == NULL) {
+		proc_destroy(proc);
+		return NULL;
+	}
+#endif
+
 	return proc;
 }
 
@@ -47,9 +47,12 @@
 #include <vfs.h>
 #include <device.h>
 #include <syscall.h>
+#include <file.h>
 #include <test.h>
 #include <version.h>
+#include <uw-vmstats.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
 
 
 /*
@@ -107,7 +110,14 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+#if OPT_A3
+	synch_bootstrap();
+#endif
 	proc_bootstrap();
+#if OPT_A3
+	trapframe_bootstrap();
+	file_bootstrap();
+#endif
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
@@ -153,6 +163,10 @@ shutdown(void)
 
 	thread_shutdown();
 
+	#if OPT_A3
+		vmstats_print();
+	#endif
+
 	splhigh();
 }
 
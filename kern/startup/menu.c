@@ -39,6 +39,7 @@
 #include <proc.h>
 #include <synch.h>
 #include <vfs.h>
+#include <vm.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -46,6 +47,7 @@
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -405,6 +407,34 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_A3
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_bstats();
+
+	return 0;
+}
+#endif
+#endif
+
 /*
  * Command for enabling debugging.
  */
@@ -490,6 +520,9 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+#if OPT_A3
+	"[sy4] RW lock test          (1)     ",
+#endif
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -530,6 +563,12 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+#if OPT_A3
+	"[cm] Coremap fragmentation stats    ",
+#if OPT_SFS
+	"[bc] SFS buffer cache stats         ",
+#endif
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -587,6 +626,12 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if OPT_A3
+	{ "cm",         cmd_coremapstats },
+#if OPT_SFS
+	{ "bc",         cmd_bufstats },
+#endif
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -604,6 +649,9 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+#if OPT_A3
+	{ "sy4",	rwtest },
+#endif
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -8,7 +8,419 @@
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include "opt-A3.h"
+#if OPT_A3
+  #include <kern/fcntl.h>
+  #include <kern/seek.h>
+  #include <stat.h>
+  #include <synch.h>
+  #include <copyinout.h>
+  #include <kmem.h>
+  #include <file.h>
+  #include <pipe.h>
+#endif //OPT_A3
 
+#if OPT_A3
+static struct kmem_cache *openfile_cache;
+
+void file_bootstrap(void) {
+  openfile_cache = kmem_cache_create("openfile", sizeof(struct openfile), NULL);
+  if (openfile_cache == NULL) {
+    panic("file_bootstrap: Out of memory\n");
+  }
+}
+
+//open files start out with one reference, for the fd they are about to go in
+static int openfile_create(struct vnode *vn, int flags, struct openfile **ret) {
+  struct openfile *of = kmem_cache_alloc(openfile_cache);
+  if (of == NULL) {
+    return ENOMEM;
+  }
+  of->of_lock = lock_create("openfile");
+  if (of->of_lock == NULL) {
+    kmem_cache_free(openfile_cache, of);
+    return ENOMEM;
+  }
+  of->of_vn = vn;
+  of->of_flags = flags;
+  of->of_offset = 0;
+  of->of_refcount = 1;
+  spinlock_init(&of->of_countlock);
+  *ret = of;
+  return 0;
+}
+
+static void openfile_incref(struct openfile *of) {
+  spinlock_acquire(&of->of_countlock);
+  of->of_refcount++;
+  spinlock_release(&of->of_countlock);
+}
+
+//the last reference closes the vnode; may sleep, so never call it holding a spinlock
+static void openfile_decref(struct openfile *of) {
+  unsigned refs;
+
+  spinlock_acquire(&of->of_countlock);
+  KASSERT(of->of_refcount > 0);
+  refs = --of->of_refcount;
+  spinlock_release(&of->of_countlock);
+  if (refs > 0) {
+    return;
+  }
+  vfs_close(of->of_vn);
+  lock_destroy(of->of_lock);
+  spinlock_cleanup(&of->of_countlock);
+  kmem_cache_free(openfile_cache, of);
+}
+
+static struct fdtable *fdtable_alloc(void) {
+  struct fdtable *ft = kmalloc(sizeof(struct fdtable));
+  if (ft == NULL) {
+    return NULL;
+  }
+  spinlock_init(&ft->ft_lock);
+  for (int i = 0; i < OPEN_MAX; i++) {
+    ft->ft_files[i] = NULL;
+  }
+  return ft;
+}
+
+//open the console into fd with the given flags
+static int fdtable_openConsole(struct fdtable *ft, int fd, int flags) {
+  char path[] = "con:"; //vfs_open may scribble on it
+  struct vnode *vn;
+  struct openfile *of;
+  int result;
+
+  result = vfs_open(path, flags, 0, &vn);
+  if (result) {
+    return result;
+  }
+  result = openfile_create(vn, flags, &of);
+  if (result) {
+    vfs_close(vn);
+    return result;
+  }
+  ft->ft_files[fd] = of;
+  return 0;
+}
+
+struct fdtable *fdtable_create(void) {
+  struct fdtable *ft = fdtable_alloc();
+  if (ft == NULL) {
+    return NULL;
+  }
+  if (fdtable_openConsole(ft, STDIN_FILENO, O_RDONLY) ||
+      fdtable_openConsole(ft, STDOUT_FILENO, O_WRONLY) ||
+      fdtable_openConsole(ft, STDERR_FILENO, O_WRONLY)) {
+    fdtable_destroy(ft);
+    return NULL;
+  }
+  return ft;
+}
+
+//the child shares every open file (and offset) with the parent, so this is just
+//a reference per fd
+struct fdtable *fdtable_copy(struct fdtable *ft) {
+  struct fdtable *newft = fdtable_alloc();
+  if (newft == NULL) {
+    return NULL;
+  }
+  spinlock_acquire(&ft->ft_lock);
+  for (int i = 0; i < OPEN_MAX; i++) {
+    if (ft->ft_files[i] != NULL) {
+      openfile_incref(ft->ft_files[i]);
+      newft->ft_files[i] = ft->ft_files[i];
+    }
+  }
+  spinlock_release(&ft->ft_lock);
+  return newft;
+}
+
+void fdtable_destroy(struct fdtable *ft) {
+  for (int i = 0; i < OPEN_MAX; i++) {
+    if (ft->ft_files[i] != NULL) {
+      openfile_decref(ft->ft_files[i]);
+      ft->ft_files[i] = NULL;
+    }
+  }
+  spinlock_cleanup(&ft->ft_lock);
+  kfree(ft);
+}
+
+//look up fd in the current process and hand back its open file with a reference
+//held, so a close from elsewhere can't pull it out from under the caller
+static int fdtable_get(int fd, struct openfile **ret) {
+  struct fdtable *ft = curproc->p_fdtable;
+  struct openfile *of;
+
+  if (fd < 0 || fd >= OPEN_MAX) {
+    return EBADF;
+  }
+  spinlock_acquire(&ft->ft_lock);
+  of = ft->ft_files[fd];
+  if (of != NULL) {
+    openfile_incref(of);
+  }
+  spinlock_release(&ft->ft_lock);
+  if (of == NULL) {
+    return EBADF;
+  }
+  *ret = of;
+  return 0;
+}
+
+//put of in the lowest free fd of the current process
+static int fdtable_add(struct openfile *of, int *retfd) {
+  struct fdtable *ft = curproc->p_fdtable;
+
+  spinlock_acquire(&ft->ft_lock);
+  for (int i = 0; i < OPEN_MAX; i++) {
+    if (ft->ft_files[i] == NULL) {
+      ft->ft_files[i] = of;
+      spinlock_release(&ft->ft_lock);
+      *retfd = i;
+      return 0;
+    }
+  }
+  spinlock_release(&ft->ft_lock);
+  return EMFILE;
+}
+
+//shared by read and write: do the transfer at the open file's offset and move it on
+static int file_rw(int fd, userptr_t ubuf, size_t nbytes, enum uio_rw rw, int *retval) {
+  struct openfile *of;
+  struct iovec iov;
+  struct uio u;
+  struct stat st;
+  int how;
+  int res;
+
+  res = fdtable_get(fd, &of);
+  if (res) {
+    return res;
+  }
+  how = of->of_flags & O_ACCMODE;
+  if ((rw == UIO_READ && how == O_WRONLY) || (rw == UIO_WRITE && how == O_RDONLY)) {
+    openfile_decref(of);
+    return EBADF;
+  }
+
+  lock_acquire(of->of_lock);
+  if (rw == UIO_WRITE && (of->of_flags & O_APPEND)) {
+    res = VOP_STAT(of->of_vn, &st);
+    if (res) {
+      lock_release(of->of_lock);
+      openfile_decref(of);
+      return res;
+    }
+    of->of_offset = st.st_size;
+  }
+
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  u.uio_iov = &iov;
+  u.uio_iovcnt = 1;
+  u.uio_offset = of->of_offset;
+  u.uio_resid = nbytes;
+  u.uio_segflg = UIO_USERSPACE;
+  u.uio_rw = rw;
+  u.uio_space = curproc->p_addrspace;
+
+  if (rw == UIO_READ) {
+    res = VOP_READ(of->of_vn, &u);
+  } else {
+    res = VOP_WRITE(of->of_vn, &u);
+  }
+  if (res == 0) {
+    of->of_offset = u.uio_offset;
+    *retval = nbytes - u.uio_resid;
+  }
+  lock_release(of->of_lock);
+  openfile_decref(of);
+  return res;
+}
+
+int sys_open(userptr_t upath, int flags, mode_t mode, int *retval) {
+  struct openfile *of;
+  struct vnode *vn;
+  char *path;
+  int res;
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  res = copyinstr(upath, path, PATH_MAX, NULL);
+  if (res) {
+    kfree(path);
+    return res;
+  }
+
+  res = vfs_open(path, flags, mode, &vn);
+  kfree(path);
+  if (res) {
+    return res;
+  }
+  res = openfile_create(vn, flags, &of);
+  if (res) {
+    vfs_close(vn);
+    return res;
+  }
+  res = fdtable_add(of, retval);
+  if (res) {
+    openfile_decref(of);
+    return res;
+  }
+  return 0;
+}
+
+int sys_read(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval) {
+  DEBUG(DB_SYSCALL,"Syscall: read(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+  return file_rw(fdesc, ubuf, nbytes, UIO_READ, retval);
+}
+
+int sys_write(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval) {
+  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+  return file_rw(fdesc, ubuf, nbytes, UIO_WRITE, retval);
+}
+
+int sys_close(int fdesc) {
+  struct fdtable *ft = curproc->p_fdtable;
+  struct openfile *of;
+
+  if (fdesc < 0 || fdesc >= OPEN_MAX) {
+    return EBADF;
+  }
+  spinlock_acquire(&ft->ft_lock);
+  of = ft->ft_files[fdesc];
+  ft->ft_files[fdesc] = NULL;
+  spinlock_release(&ft->ft_lock);
+  if (of == NULL) {
+    return EBADF;
+  }
+  openfile_decref(of);
+  return 0;
+}
+
+int sys_lseek(int fdesc, off_t pos, int whence, off_t *retval) {
+  struct openfile *of;
+  struct stat st;
+  off_t newpos = 0;
+  int res;
+
+  res = fdtable_get(fdesc, &of);
+  if (res) {
+    return res;
+  }
+
+  lock_acquire(of->of_lock);
+  switch (whence) {
+    case SEEK_SET:
+      newpos = pos;
+      break;
+    case SEEK_CUR:
+      newpos = of->of_offset + pos;
+      break;
+    case SEEK_END:
+      res = VOP_STAT(of->of_vn, &st);
+      newpos = st.st_size + pos;
+      break;
+    default:
+      res = EINVAL;
+      break;
+  }
+  if (res == 0 && newpos < 0) {
+    res = EINVAL;
+  }
+  if (res == 0) {
+    //the console and other devices can't seek
+    res = VOP_TRYSEEK(of->of_vn, newpos);
+  }
+  if (res == 0) {
+    of->of_offset = newpos;
+    *retval = newpos;
+  }
+  lock_release(of->of_lock);
+  openfile_decref(of);
+  return res;
+}
+
+int sys_pipe(userptr_t ufds, int *retval) {
+  struct vnode *rvn, *wvn;
+  struct openfile *rof, *wof;
+  int fds[2];
+  int res;
+
+  res = pipe_create(&rvn, &wvn);
+  if (res) {
+    return res;
+  }
+  res = openfile_create(rvn, O_RDONLY, &rof);
+  if (res) {
+    vfs_close(rvn);
+    vfs_close(wvn);
+    return res;
+  }
+  res = openfile_create(wvn, O_WRONLY, &wof);
+  if (res) {
+    openfile_decref(rof);
+    vfs_close(wvn);
+    return res;
+  }
+
+  //from here on closing the fds cleans up
+  res = fdtable_add(rof, &fds[0]);
+  if (res) {
+    openfile_decref(rof);
+    openfile_decref(wof);
+    return res;
+  }
+  res = fdtable_add(wof, &fds[1]);
+  if (res) {
+    sys_close(fds[0]);
+    openfile_decref(wof);
+    return res;
+  }
+  res = copyout(fds, ufds, sizeof(fds));
+  if (res) {
+    sys_close(fds[0]);
+    sys_close(fds[1]);
+    return res;
+  }
+  *retval = 0;
+  return 0;
+}
+
+int sys_dup2(int oldfd, int newfd, int *retval) {
+  struct fdtable *ft = curproc->p_fdtable;
+  struct openfile *of, *old;
+
+  if (newfd < 0 || newfd >= OPEN_MAX) {
+    return EBADF;
+  }
+  //fdtable_get hands back the reference the new fd is going to hold
+  int res = fdtable_get(oldfd, &of);
+  if (res) {
+    return res;
+  }
+
+  spinlock_acquire(&ft->ft_lock);
+  old = ft->ft_files[newfd];
+  ft->ft_files[newfd] = of;
+  spinlock_release(&ft->ft_lock);
+
+  //also drops the extra reference when oldfd == newfd
+  if (old != NULL) {
+    openfile_decref(old);
+  }
+  *retval = newfd;
+  return 0;
+}
+#endif //OPT_A3
+
+
+#if !OPT_A3
 /* handler for write() system call                  */
 /*
  * n.b.
@@ -58,3 +470,4 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
   KASSERT(*retval >= 0);
   return 0;
 }
+#endif //!OPT_A3
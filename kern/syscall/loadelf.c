@@ -91,6 +91,17 @@ load_segment(struct addrspace *as, struct vnode *v,
 		filesize = memsize;
 	}
 
+	#if OPT_A3
+		//pages are read in by vm_fault the first time they are touched
+		(void)iov;
+		(void)u;
+		(void)result;
+		(void)is_executable;
+		DEBUG(DB_EXEC, "ELF: Deferring %lu bytes at 0x%lx\n", 
+		      (unsigned long) filesize, (unsigned long) vaddr);
+		return as_define_backing(as, v, offset, vaddr, filesize);
+	#else
+
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n", 
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
@@ -144,6 +155,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 	
 	return result;
+	#endif /* OPT_A3 */
 }
 
 /*
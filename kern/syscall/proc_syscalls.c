@@ -11,6 +11,7 @@
 #include <addrspace.h>
 #include <copyinout.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 
 #if OPT_A2
@@ -18,10 +19,188 @@
   #include <vfs.h>
   #include <kern/fcntl.h>
 #endif //OPT_A2
+#if OPT_A3
+  #include <kmem.h>
+  #include <file.h>
+  #include <limits.h>
+#endif //OPT_A3
 
 //this entire file contains new changes
 
-#if OPT_A2
+#if OPT_A2 && OPT_A3
+//A new program's arguments are gathered into one block laid out exactly as
+//it will sit on the new user stack: argv[0..argc], then the strings, each
+//padded to a multiple of 4. Until execArgs_copyout moves the block, each
+//argv entry holds its string's offset from the start of the block.
+
+//copy the block to the top of the new stack in one go, pointing the argv
+//entries at the strings' user addresses
+static int execArgs_copyout(char *block, int argc, size_t len, vaddr_t *stackptr) {
+  vaddr_t *argv = (vaddr_t *) block;
+  vaddr_t base = *stackptr - ROUNDUP(len, 8); //keep the stack pointer double-word aligned
+
+  for (int i = 0; i < argc; i++) {
+    argv[i] += base;
+  }
+  argv[argc] = (vaddr_t) NULL;
+  if (copyout(block, (userptr_t) base, len)) {
+    //both ends are ours, so the only way to fail is to run off the bottom of the stack
+    return E2BIG;
+  }
+  *stackptr = base;
+  return 0;
+}
+
+//gather the user's argv into BLOCK, which is ARG_MAX bytes, copying each
+//string exactly once. Hands back the argument count and the bytes used.
+static int execArgs_copyin(userptr_t uargv, char *block, int *argc, size_t *len) {
+  vaddr_t *argv = (vaddr_t *) block;
+  size_t off, got;
+  int count, retVal;
+
+  //the pointers first, so we know where the strings start
+  for (count = 0; ; count++) {
+    if ((count + 1) * sizeof(vaddr_t) > ARG_MAX) {
+      return E2BIG;
+    }
+    retVal = copyin((const_userptr_t) ((vaddr_t) uargv + count * sizeof(vaddr_t)),
+                    &argv[count], sizeof(vaddr_t));
+    if (retVal) {
+      return retVal;
+    }
+    if (argv[count] == (vaddr_t) NULL) {
+      break;
+    }
+  }
+
+  off = (count + 1) * sizeof(vaddr_t);
+  for (int i = 0; i < count; i++) {
+    retVal = copyinstr((const_userptr_t) argv[i], block + off, ARG_MAX - off, &got);
+    if (retVal) {
+      return retVal == ENAMETOOLONG ? E2BIG : retVal;
+    }
+    argv[i] = off;
+    //zero the padding too, so no stale kernel memory ends up on the user stack
+    while (got % 4 != 0) {
+      if (off + got == ARG_MAX) {
+        return E2BIG;
+      }
+      block[off + got++] = '\0';
+    }
+    off += got;
+  }
+
+  *argc = count;
+  *len = off;
+  return 0;
+}
+
+//for runprogram, whose arguments are already in the kernel
+int copyArgs(vaddr_t *stackptr, char **kernelArgs, int count) {
+  size_t len = (count + 1) * sizeof(vaddr_t);
+  size_t off = len;
+  char *block;
+  int retVal;
+
+  for (int i = 0; i < count; i++) {
+    len += ROUNDUP(strlen(kernelArgs[i]) + 1, 4);
+  }
+  if (len > ARG_MAX) {
+    return E2BIG;
+  }
+  block = kmalloc(len);
+  if (block == NULL) {
+    return ENOMEM;
+  }
+  bzero(block, len);
+  for (int i = 0; i < count; i++) {
+    ((vaddr_t *) block)[i] = off;
+    strcpy(block + off, kernelArgs[i]);
+    off += ROUNDUP(strlen(kernelArgs[i]) + 1, 4);
+  }
+
+  retVal = execArgs_copyout(block, count, len, stackptr);
+  kfree(block);
+  return retVal;
+}
+
+//the arguments and path are copied in before anything else happens, so any
+//error up to the point the new address space is loaded leaves the caller
+//running its old program
+int sys_execv(userptr_t program, userptr_t args) {
+  struct addrspace *as, *old;
+  struct vnode *v;
+  vaddr_t entrypoint, stackptr;
+  char *path, *block;
+  size_t len;
+  int argc, result;
+
+  path = kmalloc(PATH_MAX);
+  block = kmalloc(ARG_MAX);
+  if (path == NULL || block == NULL) {
+    kfree(path);
+    kfree(block);
+    return ENOMEM;
+  }
+
+  result = copyinstr(program, path, PATH_MAX, NULL);
+  if (result == 0) {
+    result = execArgs_copyin(args, block, &argc, &len);
+  }
+  if (result) {
+    kfree(path);
+    kfree(block);
+    return result;
+  }
+
+  //vfs_open may scribble on the path, but we're done with it after this
+  result = vfs_open(path, O_RDONLY, 0, &v);
+  kfree(path);
+  if (result) {
+    kfree(block);
+    return result;
+  }
+
+  as = as_create();
+  if (as == NULL) {
+    vfs_close(v);
+    kfree(block);
+    return ENOMEM;
+  }
+
+  old = curproc_setas(as);
+  as_activate();
+
+  result = load_elf(v, &entrypoint);
+  vfs_close(v);
+  if (result == 0) {
+    result = as_define_stack(as, &stackptr);
+  }
+  if (result == 0) {
+    result = execArgs_copyout(block, argc, len, &stackptr);
+  }
+  kfree(block);
+  if (result) {
+    //go back to the old program and report the error there
+    curproc_setas(old);
+    as_activate();
+    as_destroy(as);
+    return result;
+  }
+
+  if (old != NULL) {
+    as_destroy(old);
+  }
+
+  /* Warp to user mode. */
+  enter_new_process(argc /*argc*/, (userptr_t)stackptr /*userspace addr of argv*/,
+        stackptr, entrypoint);
+
+  /* enter_new_process does not return. */
+  panic("enter_new_process returned\n");
+  return EINVAL;
+}
+#elif OPT_A2
 void copyArgs(vaddr_t *stackptr, char **kernelArgs, int count) {
   //copy arguments from user space to new address space
     vaddr_t storeArg[count + 1];
@@ -50,7 +229,7 @@ void copyArgs(vaddr_t *stackptr, char **kernelArgs, int count) {
 }
 #endif //OPT_A2
 
-#if OPT_A2
+#if OPT_A2 && !OPT_A3
   int sys_execv(userptr_t program, userptr_t args) {
     //code from runprogram.c
     struct addrspace *as;
@@ -176,8 +355,11 @@ void copyArgs(vaddr_t *stackptr, char **kernelArgs, int count) {
     }
 
     //copy and set address for child process. Look at curproc_setas() for hints
+    //as_copy may allocate page tables and frames, so don't hold p_lock across it
+    struct addrspace *childAs = NULL;
+    int safeCopy = as_copy(curproc_getas(), &childAs);
     spinlock_acquire(&childProc->p_lock);
-    int safeCopy = as_copy(curproc_getas(), &(childProc->p_addrspace));
+    childProc->p_addrspace = childAs;
     spinlock_release(&childProc->p_lock);
     //check if as_copy returned an error
     if (safeCopy != 0) {
@@ -194,7 +376,11 @@ void copyArgs(vaddr_t *stackptr, char **kernelArgs, int count) {
     lock_release(curproc->conditionLock);
 
     //make a trapframe copy in the kernel heap
+#if OPT_A3
+    struct trapframe *childTF = kmem_cache_alloc(trapframe_cache);
+#else
     struct trapframe *childTF = kmalloc(sizeof(struct trapframe));
+#endif
     if (childTF == NULL) {
       DEBUG(DB_SYSCALL,"Error creating the trapframe");
       proc_destroy(childProc);
@@ -209,7 +395,11 @@ void copyArgs(vaddr_t *stackptr, char **kernelArgs, int count) {
     if (retVal) {
       DEBUG(DB_SYSCALL,"Error in thread_fork in sys_fork");
       proc_destroy(childProc);
+#if OPT_A3
+      kmem_cache_free(trapframe_cache, childTF);
+#else
       kfree(childTF);
+#endif
       return ENOMEM;
     }
 
@@ -246,6 +436,12 @@ void sys__exit(int exitcode) {
   as = curproc_setas(NULL);
   as_destroy(as);
 
+#if OPT_A3
+  //close the files now rather than when the parent reaps us, which may be much later
+  fdtable_destroy(p->p_fdtable);
+  p->p_fdtable = NULL;
+#endif //OPT_A3
+
   /* detach this thread from its process */
   /* note: curproc cannot be used after this call */
   proc_remthread(curthread);
@@ -359,3 +555,12 @@ int sys_getpid(pid_t *retval) {
   #endif //OPT_A2
   return(0);
 }
+
+#if OPT_A3
+//lower the caller's scheduling priority by incr levels (raise it if negative), and
+//return the new nice level; the level is clamped to the range the scheduler has
+int sys_nice(int incr, int *retval) {
+  *retval = thread_nice(incr);
+  return 0;
+}
+#endif //OPT_A3
@@ -45,6 +45,7 @@
 #include <syscall.h>
 #include <test.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 /*
  * Load program "progname" and start running it in usermode.
@@ -101,7 +102,15 @@ int
 		return result;
 	}
 	#if OPT_A2
+		#if OPT_A3
+		result = copyArgs(&stackptr, args, nargs);
+		if (result) {
+			/* p_addrspace will go away when curproc is destroyed */
+			return result;
+		}
+		#else
 		copyArgs(&stackptr, args, nargs);
+		#endif
 		if (old != NULL)  as_destroy(old);
 		/* Warp to user mode. */
 		enter_new_process(nargs /*argc*/, (userptr_t)stackptr /*userspace addr of argv*/,
@@ -37,6 +37,7 @@
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
+#include "opt-A3.h"
 
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
@@ -347,3 +348,125 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+#if OPT_A3
+#define NRWLOOPS      60
+#define NRWWRITERS    4
+
+static struct rwlock *testrw;
+static volatile unsigned rwreaders;
+static volatile unsigned rwwriters;
+static volatile unsigned rwmaxreaders;
+static volatile bool rwfailed;
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	rwfailed = true;
+}
+
+/*
+ * Threads below NRWWRITERS write, the rest read. A writer must always
+ * be alone in the lock; readers check that a writer's update is never
+ * seen half done.
+ */
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (num < NRWWRITERS) {
+			rwlock_acquire_write(testrw);
+			lock_acquire(testlock);
+			rwwriters++;
+			if (rwwriters != 1 || rwreaders != 0) {
+				rwfail(num, "writer not alone");
+			}
+			lock_release(testlock);
+
+			testval1 = num;
+			for (j=0; j<500; j++);
+			testval2 = num*num;
+
+			lock_acquire(testlock);
+			rwwriters--;
+			lock_release(testlock);
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			lock_acquire(testlock);
+			rwreaders++;
+			if (rwreaders > rwmaxreaders) {
+				rwmaxreaders = rwreaders;
+			}
+			if (rwwriters != 0) {
+				rwfail(num, "reader inside with a writer");
+			}
+			lock_release(testlock);
+
+			if (testval2 != testval1*testval1) {
+				rwfail(num, "reader saw a partial write");
+			}
+			for (j=0; j<500; j++);
+
+			lock_acquire(testlock);
+			rwreaders--;
+			lock_release(testlock);
+			rwlock_release_read(testrw);
+		}
+	}
+	V(donesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	kprintf("Starting rwlock test...\n");
+
+	testval1 = 0;
+	testval2 = 0;
+	rwreaders = rwwriters = rwmaxreaders = 0;
+	rwfailed = false;
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("synchtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	rwlock_destroy(testrw);
+	testrw = NULL;
+#ifdef UW
+  cleanitems();
+#endif
+	kprintf("At most %u readers held the lock at once\n", rwmaxreaders);
+	kprintf(rwfailed ? "Test failed\n" : "RW lock test done.\n");
+
+	return 0;
+}
+#endif /* OPT_A3 */
@@ -123,10 +123,20 @@ hardclock(void)
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
+#if !OPT_A3
+	/* With OPT_A3, idle cpus steal work in thread_switch instead */
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
+#endif
+#if OPT_A3
+	/* Only switch when the quantum is up or a better thread is waiting */
+	if (thread_tick()) {
+		thread_yield();
+	}
+#else
 	thread_yield();
+#endif
 }
 
 /*
@@ -39,6 +39,11 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include "opt-A3.h"
+#if OPT_A3
+#include <cpu.h>
+#include <kmem.h>
+#endif
 
 ////////////////////////////////////////////////////////////
 //
@@ -147,19 +152,77 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+#if OPT_A3
+/* lock structures come from here, see synch_bootstrap */
+static struct kmem_cache *lock_cache;
+#define LOCK_ALLOC() kmem_cache_alloc(lock_cache)
+#define LOCK_FREE(lock) kmem_cache_free(lock_cache, (lock))
+#else
+#define LOCK_ALLOC() kmalloc(sizeof(struct lock))
+#define LOCK_FREE(lock) kfree(lock)
+#endif
+
+#if OPT_A3
+//an unheld lock always looks like this, so it only has to be set up once
+static
+void
+lock_ctor(void *obj)
+{
+        struct lock *lock = obj;
+
+        lock->owner = NULL;
+        spinlock_init(&lock->lock_lock);
+        lock->lk_sleepers = 0;
+}
+
+/*
+ * Owner value while the lock is being handed to a thread that hasn't
+ * woken up yet. It counts as held.
+ */
+#define LOCK_HANDOFF ((struct thread *)1)
+
+/* How many times to look at the lock before giving up and sleeping */
+#define LOCK_SPIN_MAX 1000
+
+/*
+ * True if OWNER is running on some other cpu right now, so the lock
+ * will probably be free soon. This peeks at another thread without
+ * any locking; it's only a hint.
+ */
+static
+bool
+lock_ownerRunning(struct thread *owner)
+{
+        if (owner == NULL || owner == LOCK_HANDOFF) {
+                return false;
+        }
+        return ((volatile struct thread *)owner)->t_state == S_RUN &&
+                owner->t_cpu != curcpu->c_self;
+}
+
+void
+synch_bootstrap(void)
+{
+        lock_cache = kmem_cache_create("lock", sizeof(struct lock), lock_ctor);
+        if (lock_cache == NULL) {
+                panic("synch_bootstrap: Out of memory\n");
+        }
+}
+#endif /* OPT_A3 */
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = LOCK_ALLOC();
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                LOCK_FREE(lock);
                 return NULL;
         }
         
@@ -167,11 +230,13 @@ lock_create(const char *name)
         lock->lock_wchan = wchan_create(lock->lk_name);
         if (lock->lock_wchan == NULL) {
                 kfree(lock->lk_name);
-                kfree(lock);
+                LOCK_FREE(lock);
                 return NULL;
         }
+#if !OPT_A3
         lock->owner = NULL;
         spinlock_init(&lock->lock_lock);
+#endif
         
         return lock;
 }
@@ -185,17 +250,57 @@ lock_destroy(struct lock *lock)
         spinlock_cleanup(&lock->lock_lock);
         wchan_destroy(lock->lock_wchan);
         kfree(lock->lk_name);
-        kfree(lock);
+#if OPT_A3
+        //spinlock_cleanup leaves it as lock_ctor made it
+        KASSERT(lock->owner == NULL);
+        KASSERT(lock->lk_sleepers == 0);
+#endif
+        LOCK_FREE(lock);
 }
 
 void
 lock_acquire(struct lock *lock)
 {
+#if OPT_A3
+        struct thread *owner;
+        unsigned spins = 0;
+#endif
+
         //make sure thread is not null when acquiring
         KASSERT(lock != NULL);
         //make sure you are not the owner calling acquire
         KASSERT(!lock_do_i_hold(lock));
+#if OPT_A3
+        KASSERT(curthread->t_in_interrupt == false);
+
+        spinlock_acquire(&lock->lock_lock);
+        while (lock->owner != NULL) {
+                //short critical sections on other cpus: wait it out without
+                //switching, watching the lock without holding its spinlock
+                owner = lock->owner;
+                if (spins < LOCK_SPIN_MAX && lock_ownerRunning(owner)) {
+                        spinlock_release(&lock->lock_lock);
+                        while (spins < LOCK_SPIN_MAX && lock->owner == owner &&
+                               lock_ownerRunning(owner)) {
+                                spins++;
+                        }
+                        spinlock_acquire(&lock->lock_lock);
+                        continue;
+                }
+
+                lock->lk_sleepers++;
+                wchan_lock(lock->lock_wchan);
+                spinlock_release(&lock->lock_lock);
+                wchan_sleep(lock->lock_wchan);
+                spinlock_acquire(&lock->lock_lock);
 
+                //lock_release picked us and kept the lock for us
+                KASSERT(lock->owner == LOCK_HANDOFF);
+                break;
+        }
+        lock->owner = curthread;
+        spinlock_release(&lock->lock_lock);
+#else
         spinlock_acquire(&lock->lock_lock);
         while(lock->owner) {
                 wchan_lock(lock->lock_wchan);
@@ -205,6 +310,7 @@ lock_acquire(struct lock *lock)
         }
         lock->owner = curthread;
         spinlock_release(&lock->lock_lock);
+#endif /* OPT_A3 */
         //(void)lock;  // suppress warning until code gets written
 }
 
@@ -217,12 +323,41 @@ lock_release(struct lock *lock)
         KASSERT(lock_do_i_hold(lock));
 
         spinlock_acquire(&lock->lock_lock);
+#if OPT_A3
+        //hand off to a sleeper if there is one; spinners only get the lock
+        //when nobody is asleep, so they can't starve sleepers
+        if (lock->lk_sleepers > 0) {
+                lock->lk_sleepers--;
+                lock->owner = LOCK_HANDOFF;
+                wchan_wakeone(lock->lock_wchan);
+        } else {
+                lock->owner = NULL;
+        }
+#else
         lock->owner = NULL;
         wchan_wakeone(lock->lock_wchan);
+#endif
         spinlock_release(&lock->lock_lock);
         //(void)lock;  // suppress warning until code gets written
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+        bool acquired = false;
+
+        KASSERT(lock != NULL);
+        KASSERT(!lock_do_i_hold(lock));
+
+        spinlock_acquire(&lock->lock_lock);
+        if (lock->owner == NULL) {
+                lock->owner = curthread;
+                acquired = true;
+        }
+        spinlock_release(&lock->lock_lock);
+        return acquired;
+}
+
 bool
 lock_do_i_hold(struct lock *lock)
 {
@@ -317,3 +452,188 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	// (void)cv;    // suppress warning until code gets written
 	// (void)lock;  // suppress warning until code gets written
 }
+
+#if OPT_A3
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+        struct rwlock *rw;
+
+        rw = kmalloc(sizeof(struct rwlock));
+        if (rw == NULL) {
+                return NULL;
+        }
+
+        rw->rwlock_name = kstrdup(name);
+        if (rw->rwlock_name == NULL) {
+                kfree(rw);
+                return NULL;
+        }
+
+        rw->rw_readwchan = wchan_create(rw->rwlock_name);
+        if (rw->rw_readwchan == NULL) {
+                kfree(rw->rwlock_name);
+                kfree(rw);
+                return NULL;
+        }
+        rw->rw_writewchan = wchan_create(rw->rwlock_name);
+        if (rw->rw_writewchan == NULL) {
+                wchan_destroy(rw->rw_readwchan);
+                kfree(rw->rwlock_name);
+                kfree(rw);
+                return NULL;
+        }
+
+        spinlock_init(&rw->rw_lock);
+        rw->rw_readers = 0;
+        rw->rw_writer = NULL;
+        rw->rw_waitreaders = 0;
+        rw->rw_waitwriters = 0;
+        rw->rw_writebatch = 0;
+
+        return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(rw->rw_readers == 0);
+        KASSERT(rw->rw_writer == NULL);
+        KASSERT(rw->rw_waitreaders == 0 && rw->rw_waitwriters == 0);
+
+        spinlock_cleanup(&rw->rw_lock);
+        wchan_destroy(rw->rw_writewchan);
+        wchan_destroy(rw->rw_readwchan);
+        kfree(rw->rwlock_name);
+        kfree(rw);
+}
+
+/*
+ * Give the lock to the next waiting writer. Called with rw_lock held
+ * and the lock otherwise free.
+ */
+static
+void
+rwlock_handWriter(struct rwlock *rw)
+{
+        KASSERT(rw->rw_readers == 0 && rw->rw_writer == NULL);
+        KASSERT(rw->rw_waitwriters > 0);
+
+        if (rw->rw_waitreaders > 0) {
+                rw->rw_writebatch++;
+        }
+        rw->rw_waitwriters--;
+        rw->rw_writer = LOCK_HANDOFF;
+        wchan_wakeone(rw->rw_writewchan);
+}
+
+/*
+ * Let every waiting reader in at once. Called with rw_lock held and
+ * no writer inside.
+ */
+static
+void
+rwlock_handReaders(struct rwlock *rw)
+{
+        KASSERT(rw->rw_writer == NULL);
+
+        rw->rw_readers += rw->rw_waitreaders;
+        rw->rw_waitreaders = 0;
+        rw->rw_writebatch = 0;
+        wchan_wakeall(rw->rw_readwchan);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+        KASSERT(rw->rw_writer != curthread);
+
+        spinlock_acquire(&rw->rw_lock);
+        if (rw->rw_writer == NULL && rw->rw_waitwriters == 0) {
+                rw->rw_readers++;
+                spinlock_release(&rw->rw_lock);
+                return;
+        }
+
+        //whoever wakes us has already counted us in rw_readers
+        rw->rw_waitreaders++;
+        wchan_lock(rw->rw_readwchan);
+        spinlock_release(&rw->rw_lock);
+        wchan_sleep(rw->rw_readwchan);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_readers > 0);
+        KASSERT(rw->rw_writer == NULL);
+        rw->rw_readers--;
+        if (rw->rw_readers == 0 && rw->rw_waitwriters > 0) {
+                rwlock_handWriter(rw);
+        }
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+        KASSERT(rw->rw_writer != curthread);
+
+        spinlock_acquire(&rw->rw_lock);
+        if (rw->rw_writer == NULL && rw->rw_readers == 0) {
+                rw->rw_writer = curthread;
+                spinlock_release(&rw->rw_lock);
+                return;
+        }
+
+        rw->rw_waitwriters++;
+        wchan_lock(rw->rw_writewchan);
+        spinlock_release(&rw->rw_lock);
+        wchan_sleep(rw->rw_writewchan);
+
+        spinlock_acquire(&rw->rw_lock);
+        //rwlock_handWriter picked us and kept the lock for us
+        KASSERT(rw->rw_writer == LOCK_HANDOFF);
+        rw->rw_writer = curthread;
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(rwlock_do_i_hold_write(rw));
+
+        spinlock_acquire(&rw->rw_lock);
+        rw->rw_writer = NULL;
+        //writers go first, but only RWLOCK_WRITER_BATCH of them in a row
+        //while readers are waiting
+        if (rw->rw_waitreaders > 0 &&
+            (rw->rw_waitwriters == 0 ||
+             rw->rw_writebatch >= RWLOCK_WRITER_BATCH)) {
+                rwlock_handReaders(rw);
+        } else if (rw->rw_waitwriters > 0) {
+                rwlock_handWriter(rw);
+        }
+        spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        return rw->rw_writer == curthread;
+}
+#endif /* OPT_A3 */
@@ -52,11 +52,31 @@
 #include <vnode.h>
 
 #include "opt-synchprobs.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <kmem.h>
+#endif
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+#if OPT_A3
+/*
+ * How often everything on a run queue goes back to its base level,
+ * so threads stuck at the bottom can't starve. This is about once a
+ * second, and must be a multiple of SCHEDULE_HARDCLOCKS (in clock.c)
+ * since schedule() is what does it.
+ */
+#define THREAD_BOOST_HARDCLOCKS 100
+
+/*
+ * A thread that ran within this many hardclocks still has its working
+ * set in its cpu's cache, so idle cpus leave it alone if they can.
+ */
+#define STEAL_HOT_HARDCLOCKS 2
+#endif
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -72,6 +92,18 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+#if OPT_A3
+/* Thread structures come from here, see thread_bootstrap. */
+static struct kmem_cache *thread_cache;
+#define THREAD_ALLOC() kmem_cache_alloc(thread_cache)
+#define THREAD_FREE(thread) kmem_cache_free(thread_cache, (thread))
+
+static struct thread *thread_steal(void);
+#else
+#define THREAD_ALLOC() kmalloc(sizeof(struct thread))
+#define THREAD_FREE(thread) kfree(thread)
+#endif
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -123,14 +155,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = THREAD_ALLOC();
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		THREAD_FREE(thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -149,6 +181,14 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+#if OPT_A3
+	/* Scheduling fields */
+	thread->t_priority = 0;
+	thread->t_basepriority = 0;
+	thread->t_quantum = THREAD_QUANTUM(0);
+	thread->t_lastrun = 0;
+#endif
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -180,6 +220,13 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+#if OPT_A3
+	c->c_pagecache_count = 0;
+	c->c_asid = 0;
+	c->c_asidgen = 0;
+	c->c_tlbhand = 0;
+	c->c_tlbfree = 0;
+#endif
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -259,7 +306,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	THREAD_FREE(thread);
 }
 
 /*
@@ -349,6 +396,12 @@ thread_bootstrap(void)
 	struct cpu *bootcpu;
 	struct thread *bootthread;
 
+#if OPT_A3
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread), NULL);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+#endif
 	cpuarray_init(&allcpus);
 
 	/*
@@ -426,6 +479,31 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Put T on C's run queue, which must be locked. The queue is kept
+ * sorted by level, first in first out within a level.
+ */
+static
+void
+thread_enqueue(struct cpu *c, struct thread *t)
+{
+#if OPT_A3
+	struct threadlistnode *tln;
+
+	//walk back from the tail past everything at a worse level
+	for (tln = c->c_runqueue.tl_tail.tln_prev; tln->tln_self != NULL;
+	     tln = tln->tln_prev) {
+		if (tln->tln_self->t_priority <= t->t_priority) {
+			threadlist_insertafter(&c->c_runqueue, tln->tln_self, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+#else
+	threadlist_addtail(&c->c_runqueue, t);
+#endif
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +528,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	thread_enqueue(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -506,6 +584,12 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+#if OPT_A3
+	/* The child inherits the nice level but starts at the top of it */
+	newthread->t_basepriority = curthread->t_basepriority;
+	newthread->t_priority = newthread->t_basepriority;
+	newthread->t_quantum = THREAD_QUANTUM(newthread->t_priority);
+#endif
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -630,11 +714,22 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 */
 
 	/* The current cpu is now idle. */
+#if OPT_A3
+	cur->t_lastrun = curcpu->c_hardclocks;
+#endif
 	curcpu->c_isidle = true;
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+#if OPT_A3
+			/* Nothing to do here; try to take work from a busy cpu. */
+			next = thread_steal();
+			if (next != NULL) {
+				spinlock_acquire(&curcpu->c_runqueue_lock);
+				break;
+			}
+#endif
 			cpu_idle();
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
@@ -826,6 +921,113 @@ thread_yield(void)
  * the current CPU's run queue by job priority.
  */
 
+#if OPT_A3
+/*
+ * The run queues are kept in order by thread_enqueue, so all there is
+ * to do here is the periodic boost: every THREAD_BOOST_HARDCLOCKS put
+ * all the threads on this cpu back on their base level, which means
+ * sorting the queue again (stably, so the order within a level holds).
+ */
+void
+schedule(void)
+{
+	struct threadlist levels[THREAD_NPRIO];
+	struct thread *t;
+	int i;
+
+	if ((curcpu->c_hardclocks % THREAD_BOOST_HARDCLOCKS) != 0) {
+		return;
+	}
+
+	for (i = 0; i < THREAD_NPRIO; i++) {
+		threadlist_init(&levels[i]);
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = curthread->t_basepriority;
+		curthread->t_quantum = THREAD_QUANTUM(curthread->t_priority);
+	}
+	while ((t = threadlist_remhead(&curcpu->c_runqueue)) != NULL) {
+		t->t_priority = t->t_basepriority;
+		t->t_quantum = THREAD_QUANTUM(t->t_priority);
+		threadlist_addtail(&levels[t->t_priority], t);
+	}
+	for (i = 0; i < THREAD_NPRIO; i++) {
+		while ((t = threadlist_remhead(&levels[i])) != NULL) {
+			threadlist_addtail(&curcpu->c_runqueue, t);
+		}
+		threadlist_cleanup(&levels[i]);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+bool
+thread_tick(void)
+{
+	struct thread *cur = curthread;
+	struct thread *next;
+	bool preempt;
+
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	//used up the quantum: drop a level and go to the back of the line
+	if (--cur->t_quantum <= 0) {
+		if (cur->t_priority < THREAD_NPRIO - 1) {
+			cur->t_priority++;
+		}
+		cur->t_quantum = THREAD_QUANTUM(cur->t_priority);
+		return true;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	next = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+	preempt = next != NULL && next->t_priority < cur->t_priority;
+	spinlock_release(&curcpu->c_runqueue_lock);
+	return preempt;
+}
+
+int
+thread_nice(int incr)
+{
+	struct thread *cur = curthread;
+	int base;
+	int spl;
+
+	spl = splhigh();
+	base = cur->t_basepriority + incr;
+	if (base < 0) {
+		base = 0;
+	}
+	if (base > THREAD_NPRIO - 1) {
+		base = THREAD_NPRIO - 1;
+	}
+	cur->t_basepriority = base;
+	if (cur->t_priority < base) {
+		cur->t_priority = base;
+		cur->t_quantum = THREAD_QUANTUM(base);
+	}
+	splx(spl);
+	return base;
+}
+
+/*
+ * A thread that slept gave up the cpu before its quantum was gone,
+ * which is what interactive and I/O-bound threads do: move it up a
+ * level, with a fresh quantum. It isn't on any run queue yet.
+ */
+static
+void
+thread_wakeboost(struct thread *t)
+{
+	if (t->t_priority > t->t_basepriority) {
+		t->t_priority--;
+	}
+	t->t_quantum = THREAD_QUANTUM(t->t_priority);
+}
+#else
 void
 schedule(void)
 {
@@ -834,7 +1036,72 @@ schedule(void)
 	 * round-robin fashion.
 	 */
 }
+#endif /* OPT_A3 */
 
+#if OPT_A3
+/*
+ * Work stealing, done by a cpu about to go idle (with its own run
+ * queue unlocked). The victim is the cpu with the longest run queue;
+ * the lengths are read without locking, since a stale guess only costs
+ * a wasted look, so only the victim's run queue is ever locked. From
+ * it we take the last thread (the one that would wait longest) that
+ * isn't still cache-hot there, or the last one of all if the victim
+ * has two or more waiting. Returns the thread, now belonging to this
+ * cpu, or NULL.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim = NULL;
+	struct threadlistnode *tln;
+	struct thread *t, *found = NULL;
+	unsigned i, numcpus, best = 0;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && c->c_runqueue.tl_count > best) {
+			best = c->c_runqueue.tl_count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	for (tln = victim->c_runqueue.tl_tail.tln_prev; tln->tln_self != NULL;
+	     tln = tln->tln_prev) {
+		t = tln->tln_self;
+		/*
+		 * The victim's curthread can be on its run queue while the
+		 * victim is coming out of idle in thread_switch; it must
+		 * never be moved.
+		 */
+		if (t == victim->c_curthread) {
+			continue;
+		}
+		if (victim->c_hardclocks - t->t_lastrun >= STEAL_HOT_HARDCLOCKS) {
+			found = t;
+			break;
+		}
+		if (found == NULL && victim->c_runqueue.tl_count >= 2) {
+			found = t;
+		}
+	}
+	if (found != NULL) {
+		threadlist_remove(&victim->c_runqueue, found);
+		found->t_cpu = curcpu->c_self;
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      found->t_name, victim->c_number, curcpu->c_number);
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+	return found;
+}
+#endif /* OPT_A3 */
+
+#if !OPT_A3
 /*
  * Thread migration.
  *
@@ -924,7 +1191,7 @@ thread_consider_migration(void)
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			thread_enqueue(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -948,7 +1215,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			thread_enqueue(curcpu->c_self, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -956,6 +1223,7 @@ thread_consider_migration(void)
 	KASSERT(threadlist_isempty(&victims));
 	threadlist_cleanup(&victims);
 }
+#endif /* !OPT_A3 */
 
 ////////////////////////////////////////////////////////////
 
@@ -1050,6 +1318,9 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
+#if OPT_A3
+	thread_wakeboost(target);
+#endif
 	thread_make_runnable(target, false);
 }
 
@@ -1084,6 +1355,9 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+#if OPT_A3
+		thread_wakeboost(target);
+#endif
 		thread_make_runnable(target, false);
 	}
 
@@ -1162,6 +1436,25 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+#if OPT_A3
+unsigned
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping, uint32_t cpus)
+{
+	unsigned i, n = 0;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self &&
+		    (cpus & ((uint32_t)1 << c->c_number)) != 0) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+#endif /* OPT_A3 */
+
 void
 interprocessor_interrupt(void)
 {
@@ -43,6 +43,7 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include "opt-A3.h"
 
 /*
  * Structure for a single named device.
@@ -86,6 +87,14 @@ DECLARRAY(knowndev);
 DEFARRAY(knowndev, /*no inline*/);
 
 static struct knowndevarray *knowndevs;
+#if OPT_A3
+/*
+ * Guards knowndevs and each entry's kd_fs. Lookups take it shared;
+ * adding a device and (un)mounting take it exclusive. Taken after
+ * vfs_biglock when both are needed.
+ */
+static struct rwlock *knowndevs_lock;
+#endif
 
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
@@ -102,6 +111,12 @@ vfs_bootstrap(void)
 	if (knowndevs==NULL) {
 		panic("vfs: Could not create knowndevs array\n");
 	}
+#if OPT_A3
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+#endif
 
 	vfs_biglock = lock_create("vfs_biglock");
 	if (vfs_biglock==NULL) {
@@ -109,6 +124,10 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+#if OPT_A3
+	vfs_dcache_bootstrap();
+#endif
+
 	devnull_create();
 }
 
@@ -155,6 +174,9 @@ vfs_sync(void)
 	unsigned i, num;
 
 	vfs_biglock_acquire();
+#if OPT_A3
+	rwlock_acquire_read(knowndevs_lock);
+#endif
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -164,6 +186,9 @@ vfs_sync(void)
 		}
 	}
 
+#if OPT_A3
+	rwlock_release_read(knowndevs_lock);
+#endif
 	vfs_biglock_release();
 
 	return 0;
@@ -173,13 +198,23 @@ vfs_sync(void)
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
  */
+#if OPT_A3
+static
+int
+knowndevs_getroot(const char *devname, struct vnode **result)
+#else
 int
 vfs_getroot(const char *devname, struct vnode **result)
+#endif
 {
 	struct knowndev *kd;
 	unsigned i, num;
 
+#if OPT_A3
+	/* knowndevs_lock is held by vfs_getroot */
+#else
 	KASSERT(vfs_biglock_do_i_hold());
+#endif
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -250,6 +285,19 @@ vfs_getroot(const char *devname, struct vnode **result)
 	return ENODEV;
 }
 
+#if OPT_A3
+int
+vfs_getroot(const char *devname, struct vnode **result)
+{
+	int err;
+
+	rwlock_acquire_read(knowndevs_lock);
+	err = knowndevs_getroot(devname, result);
+	rwlock_release_read(knowndevs_lock);
+	return err;
+}
+#endif
+
 /*
  * Given a filesystem, hand back the name of the device it's mounted on.
  */
@@ -261,8 +309,11 @@ vfs_getdevname(struct fs *fs)
 
 	KASSERT(fs != NULL);
 
+#if OPT_A3
+	rwlock_acquire_read(knowndevs_lock);
+#else
 	KASSERT(vfs_biglock_do_i_hold());
-
+#endif
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -274,9 +325,15 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
+#if OPT_A3
+			rwlock_release_read(knowndevs_lock);
+#endif
 			return kd->kd_name;
 		}
 	}
+#if OPT_A3
+	rwlock_release_read(knowndevs_lock);
+#endif
 
 	return NULL;
 }
@@ -339,6 +396,9 @@ badnames(const char *n1, const char *n2, const char *n3)
 	struct knowndev *kd;
 
 	KASSERT(vfs_biglock_do_i_hold());
+#if OPT_A3
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
+#endif
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -411,7 +471,13 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		volname = FSOP_GETVOLNAME(fs);
 	}
 
+#if OPT_A3
+	rwlock_acquire_write(knowndevs_lock);
+#endif
 	if (badnames(name, rawname, volname)) {
+#if OPT_A3
+		rwlock_release_write(knowndevs_lock);
+#endif
 		vfs_biglock_release();
 		return EEXIST;
 	}
@@ -423,6 +489,9 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		dev->d_devnumber = index+1;
 	}
 
+#if OPT_A3
+	rwlock_release_write(knowndevs_lock);
+#endif
 	vfs_biglock_release();
 	return result;
 
@@ -470,7 +539,8 @@ vfs_addfs(const char *devname, struct fs *fs)
 
 /*
  * Look for a mountable device named DEVNAME.
- * Should already hold knowndevs_lock.
+ * Should already hold vfs_biglock, which keeps mount and unmount
+ * from running concurrently.
  */
 static
 int
@@ -482,6 +552,9 @@ findmount(const char *devname, struct knowndev **result)
 
 	KASSERT(vfs_biglock_do_i_hold());
 
+#if OPT_A3
+	rwlock_acquire_read(knowndevs_lock);
+#endif
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
 		dev = knowndevarray_get(knowndevs, i);
@@ -495,6 +568,9 @@ findmount(const char *devname, struct knowndev **result)
 			found = true;
 		}
 	}
+#if OPT_A3
+	rwlock_release_read(knowndevs_lock);
+#endif
 
 	return found ? 0 : ENODEV;
 }
@@ -537,7 +613,13 @@ vfs_mount(const char *devname, void *data,
 
 	KASSERT(fs != NULL);
 
+#if OPT_A3
+	rwlock_acquire_write(knowndevs_lock);
+	kd->kd_fs = fs;
+	rwlock_release_write(knowndevs_lock);
+#else
 	kd->kd_fs = fs;
+#endif
 
 	volname = FSOP_GETVOLNAME(fs);
 	kprintf("vfs: Mounted %s: on %s\n",
@@ -571,11 +653,34 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+#if OPT_A3
+	/* The name cache holds vnodes; let them go */
+	vfs_dcache_purge(kd->kd_fs);
+#endif
+
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
 		goto fail;
 	}
 
+#if OPT_A3
+	/*
+	 * Lookups find the fs through knowndevs without vfs_biglock,
+	 * so hold them off until it's gone and dropped from the table.
+	 */
+	rwlock_acquire_write(knowndevs_lock);
+	result = FSOP_UNMOUNT(kd->kd_fs);
+	if (result == 0) {
+		/* now drop the filesystem */
+		kd->kd_fs = NULL;
+	}
+	rwlock_release_write(knowndevs_lock);
+	if (result) {
+		goto fail;
+	}
+
+	kprintf("vfs: Unmounted %s:\n", kd->kd_name);
+#else
 	result = FSOP_UNMOUNT(kd->kd_fs);
 	if (result) {
 		goto fail;
@@ -585,6 +690,7 @@ vfs_unmount(const char *devname)
 
 	/* now drop the filesystem */
 	kd->kd_fs = NULL;
+#endif
 
 	KASSERT(result==0);
 
@@ -605,9 +711,25 @@ vfs_unmountall(void)
 
 	vfs_biglock_acquire();
 
+#if OPT_A3
+	/* The name cache holds vnodes; let them go */
+	vfs_dcache_purge(NULL);
+
+	/* devices are never removed, so entries stay valid unlocked */
+	rwlock_acquire_read(knowndevs_lock);
+	num = knowndevarray_num(knowndevs);
+	rwlock_release_read(knowndevs_lock);
+#else
 	num = knowndevarray_num(knowndevs);
+#endif
 	for (i=0; i<num; i++) {
+#if OPT_A3
+		rwlock_acquire_read(knowndevs_lock);
 		dev = knowndevarray_get(knowndevs, i);
+		rwlock_release_read(knowndevs_lock);
+#else
+		dev = knowndevarray_get(knowndevs, i);
+#endif
 		if (dev->kd_rawname == NULL) {
 			/* not mountable/unmountable */
 			continue;
@@ -633,7 +755,17 @@ vfs_unmountall(void)
 			}
 		}
 
+#if OPT_A3
+		rwlock_acquire_write(knowndevs_lock);
+		result = FSOP_UNMOUNT(dev->kd_fs);
+		if (result == 0) {
+			/* now drop the filesystem */
+			dev->kd_fs = NULL;
+		}
+		rwlock_release_write(knowndevs_lock);
+#else
 		result = FSOP_UNMOUNT(dev->kd_fs);
+#endif
 		if (result == EBUSY) {
 			kprintf("vfs: Cannot unmount %s: (busy)\n", 
 				dev->kd_name);
@@ -646,8 +778,10 @@ vfs_unmountall(void)
 			continue;
 		}
 
+#if !OPT_A3
 		/* now drop the filesystem */
 		dev->kd_fs = NULL;
+#endif
 	}
 
 	vfs_biglock_release();
@@ -39,8 +39,13 @@
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include "opt-A3.h"
 
 static struct vnode *bootfs_vnode = NULL;
+#if OPT_A3
+/* Lookups don't take vfs_biglock, so bootfs_vnode gets its own lock */
+static struct spinlock bootfs_lock = SPINLOCK_INITIALIZER;
+#endif
 
 /*
  * Helper function for actually changing bootfs_vnode.
@@ -51,8 +56,15 @@ change_bootfs(struct vnode *newvn)
 {
 	struct vnode *oldvn;
 
+#if OPT_A3
+	spinlock_acquire(&bootfs_lock);
 	oldvn = bootfs_vnode;
 	bootfs_vnode = newvn;
+	spinlock_release(&bootfs_lock);
+#else
+	oldvn = bootfs_vnode;
+	bootfs_vnode = newvn;
+#endif
 
 	if (oldvn != NULL) {
 		VOP_DECREF(oldvn);
@@ -133,7 +145,9 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
+#if !OPT_A3
 	KASSERT(vfs_biglock_do_i_hold());
+#endif
 
 	/*
 	 * Locate the first colon or slash.
@@ -188,11 +202,22 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	KASSERT(colon==0 || slash==0);
 
 	if (path[0]=='/') {
+#if OPT_A3
+		spinlock_acquire(&bootfs_lock);
+		if (bootfs_vnode==NULL) {
+			spinlock_release(&bootfs_lock);
+			return ENOENT;
+		}
+		VOP_INCREF(bootfs_vnode);
+		*startvn = bootfs_vnode;
+		spinlock_release(&bootfs_lock);
+#else
 		if (bootfs_vnode==NULL) {
 			return ENOENT;
 		}
 		VOP_INCREF(bootfs_vnode);
 		*startvn = bootfs_vnode;
+#endif
 	}
 	else {
 		KASSERT(path[0]==':');
@@ -223,6 +248,293 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * Name lookup cache.
+ *
+ * Remembers what VOP_LOOKUP returned for a (directory, name) pair,
+ * including ENOENT, so that looking up the same path again doesn't
+ * go back to the filesystem. The name is whatever vfs_lookup passed
+ * down after the device part: a single component for sfs, possibly
+ * a longer path for emufs. Each entry holds a reference to the
+ * directory and, unless it's a negative entry, to the vnode found.
+ *
+ * Since a name may span several components, removing or renaming
+ * anything drops every entry for that filesystem; creating
+ * something drops its negative entries. These calls come after the
+ * filesystem has made the change. dcache_gen counts them, so a
+ * lookup that raced with one doesn't put back what it saw before.
+ *
+ * Entries are recycled in LRU order. dcache_lock is a spinlock, so
+ * references are dropped only after letting go of it.
+ */
+#define DCACHE_SIZE     128
+#define DCACHE_BUCKETS  64
+#define DCACHE_NAMELEN  64      /* longer names aren't cached */
+
+struct dcache_entry {
+	struct dcache_entry *de_next;           /* hash chain */
+	struct dcache_entry *de_lruprev;
+	struct dcache_entry *de_lrunext;
+	struct vnode *de_dir;                   /* NULL if unused */
+	struct vnode *de_vn;                    /* NULL if negative */
+	unsigned de_bucket;
+	char de_name[DCACHE_NAMELEN];
+};
+
+static struct dcache_entry dcache[DCACHE_SIZE];
+static struct dcache_entry *dcache_hash[DCACHE_BUCKETS];
+static struct dcache_entry dcache_lru;  /* most recent at lrunext */
+static unsigned dcache_gen;
+static struct spinlock dcache_lock = SPINLOCK_INITIALIZER;
+
+static
+unsigned
+dcache_hashFn(struct vnode *dir, const char *name)
+{
+	unsigned h = (unsigned)(uintptr_t)dir >> 4;
+
+	while (*name) {
+		h = h * 33 + (unsigned char)*name++;
+	}
+	return h % DCACHE_BUCKETS;
+}
+
+static
+void
+dcache_lruRemove(struct dcache_entry *de)
+{
+	de->de_lruprev->de_lrunext = de->de_lrunext;
+	de->de_lrunext->de_lruprev = de->de_lruprev;
+}
+
+/* Put DE at the recent end of the LRU list, or the other end if OLD */
+static
+void
+dcache_lruInsert(struct dcache_entry *de, bool old)
+{
+	if (old) {
+		de->de_lrunext = &dcache_lru;
+		de->de_lruprev = dcache_lru.de_lruprev;
+	}
+	else {
+		de->de_lruprev = &dcache_lru;
+		de->de_lrunext = dcache_lru.de_lrunext;
+	}
+	de->de_lruprev->de_lrunext = de;
+	de->de_lrunext->de_lruprev = de;
+}
+
+static
+struct dcache_entry *
+dcache_find(struct vnode *dir, const char *name, unsigned bucket)
+{
+	struct dcache_entry *de;
+
+	KASSERT(spinlock_do_i_hold(&dcache_lock));
+
+	for (de = dcache_hash[bucket]; de != NULL; de = de->de_next) {
+		if (de->de_dir == dir && !strcmp(de->de_name, name)) {
+			return de;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take DE out of the cache and hand back the references it held.
+ */
+static
+void
+dcache_drop(struct dcache_entry *de, struct vnode **dir, struct vnode **vn)
+{
+	struct dcache_entry **pp;
+
+	KASSERT(spinlock_do_i_hold(&dcache_lock));
+	KASSERT(de->de_dir != NULL);
+
+	for (pp = &dcache_hash[de->de_bucket]; *pp != de;
+	     pp = &(*pp)->de_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = de->de_next;
+
+	*dir = de->de_dir;
+	*vn = de->de_vn;
+	de->de_dir = NULL;
+	de->de_vn = NULL;
+
+	dcache_lruRemove(de);
+	dcache_lruInsert(de, true);
+}
+
+static
+void
+dcache_release(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+/*
+ * Remember the result of looking up NAME in DIR, unless the cache
+ * has been purged since the lookup started (GEN).
+ */
+static
+void
+dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+	     unsigned gen)
+{
+	struct dcache_entry *de;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	unsigned bucket;
+
+	bucket = dcache_hashFn(dir, name);
+
+	spinlock_acquire(&dcache_lock);
+	if (gen != dcache_gen || dcache_find(dir, name, bucket) != NULL) {
+		spinlock_release(&dcache_lock);
+		return;
+	}
+
+	de = dcache_lru.de_lruprev;
+	if (de->de_dir != NULL) {
+		dcache_drop(de, &olddir, &oldvn);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	de->de_dir = dir;
+	de->de_vn = vn;
+	de->de_bucket = bucket;
+	strcpy(de->de_name, name);
+	de->de_next = dcache_hash[bucket];
+	dcache_hash[bucket] = de;
+	dcache_lruRemove(de);
+	dcache_lruInsert(de, false);
+	spinlock_release(&dcache_lock);
+
+	dcache_release(olddir, oldvn);
+}
+
+/*
+ * VOP_LOOKUP, through the cache.
+ */
+static
+int
+dcache_lookup(struct vnode *dir, char *name, struct vnode **ret)
+{
+	struct dcache_entry *de;
+	char key[DCACHE_NAMELEN];
+	unsigned bucket, gen;
+	int result;
+
+	if (strlen(name) >= sizeof(key)) {
+		return VOP_LOOKUP(dir, name, ret);
+	}
+	/* VOP_LOOKUP may scribble on the name */
+	strcpy(key, name);
+	bucket = dcache_hashFn(dir, key);
+
+	spinlock_acquire(&dcache_lock);
+	de = dcache_find(dir, key, bucket);
+	if (de != NULL) {
+		if (de->de_vn != NULL) {
+			VOP_INCREF(de->de_vn);
+			*ret = de->de_vn;
+			result = 0;
+		}
+		else {
+			result = ENOENT;
+		}
+		dcache_lruRemove(de);
+		dcache_lruInsert(de, false);
+		spinlock_release(&dcache_lock);
+		return result;
+	}
+	gen = dcache_gen;
+	spinlock_release(&dcache_lock);
+
+	result = VOP_LOOKUP(dir, name, ret);
+	if (result == 0) {
+		dcache_enter(dir, key, *ret, gen);
+	}
+	else if (result == ENOENT) {
+		dcache_enter(dir, key, NULL, gen);
+	}
+	return result;
+}
+
+/*
+ * Drop the entries for FS (or all of them, if FS is NULL); if
+ * NEGONLY, just the negative ones.
+ */
+static
+void
+dcache_purge(struct fs *fs, bool negonly)
+{
+	struct dcache_entry *de;
+	struct vnode *dir, *vn;
+	unsigned i;
+
+	spinlock_acquire(&dcache_lock);
+	dcache_gen++;
+	for (i=0; i<DCACHE_SIZE; i++) {
+		de = &dcache[i];
+		if (de->de_dir == NULL) {
+			continue;
+		}
+		if (fs != NULL && de->de_dir->vn_fs != fs) {
+			continue;
+		}
+		if (negonly && de->de_vn != NULL) {
+			continue;
+		}
+		dcache_drop(de, &dir, &vn);
+		spinlock_release(&dcache_lock);
+		dcache_release(dir, vn);
+		spinlock_acquire(&dcache_lock);
+	}
+	spinlock_release(&dcache_lock);
+}
+
+void
+vfs_dcache_bootstrap(void)
+{
+	unsigned i;
+
+	dcache_lru.de_lrunext = &dcache_lru;
+	dcache_lru.de_lruprev = &dcache_lru;
+	for (i=0; i<DCACHE_SIZE; i++) {
+		dcache[i].de_dir = NULL;
+		dcache[i].de_vn = NULL;
+		dcache_lruInsert(&dcache[i], true);
+	}
+	for (i=0; i<DCACHE_BUCKETS; i++) {
+		dcache_hash[i] = NULL;
+	}
+	dcache_gen = 0;
+}
+
+void
+vfs_dcache_purge(struct fs *fs)
+{
+	dcache_purge(fs, false);
+}
+
+void
+vfs_dcache_purgenegative(struct fs *fs)
+{
+	dcache_purge(fs, true);
+}
+#endif /* OPT_A3 */
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
@@ -235,11 +547,15 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
+#if !OPT_A3
 	vfs_biglock_acquire();
+#endif
 
 	result = getdevice(path, &path, &startvn);
 	if (result) {
+#if !OPT_A3
 		vfs_biglock_release();
+#endif
 		return result;
 	}
 
@@ -257,7 +573,9 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
+#if !OPT_A3
 	vfs_biglock_release();
+#endif
 	return result;
 }
 
@@ -267,23 +585,35 @@ vfs_lookup(char *path, struct vnode **retval)
 	struct vnode *startvn;
 	int result;
 
+#if !OPT_A3
 	vfs_biglock_acquire();
+#endif
 
 	result = getdevice(path, &path, &startvn);
 	if (result) {
+#if !OPT_A3
 		vfs_biglock_release();
+#endif
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
+#if !OPT_A3
 		vfs_biglock_release();
+#endif
 		return 0;
 	}
 
+#if OPT_A3
+	result = dcache_lookup(startvn, path, retval);
+#else
 	result = VOP_LOOKUP(startvn, path, retval);
+#endif
 
 	VOP_DECREF(startvn);
+#if !OPT_A3
 	vfs_biglock_release();
+#endif
 	return result;
 }
@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <vfs.h>
 #include <vnode.h>
+#include "opt-A3.h"
 
 
 /* Does most of the work for open(). */
@@ -74,6 +75,11 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+#if OPT_A3
+		if (result == 0) {
+			vfs_dcache_purgenegative(dir->vn_fs);
+		}
+#endif
 
 		VOP_DECREF(dir);
 	}
@@ -150,6 +156,11 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+#if OPT_A3
+	if (result == 0) {
+		vfs_dcache_purge(dir->vn_fs);
+	}
+#endif
 	VOP_DECREF(dir);
 
 	return result;
@@ -183,6 +194,11 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+#if OPT_A3
+	if (result == 0) {
+		vfs_dcache_purge(olddir->vn_fs);
+	}
+#endif
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -217,6 +233,11 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+#if OPT_A3
+	if (result == 0) {
+		vfs_dcache_purgenegative(newdir->vn_fs);
+	}
+#endif
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -244,6 +265,11 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+#if OPT_A3
+	if (result == 0) {
+		vfs_dcache_purgenegative(newdir->vn_fs);
+	}
+#endif
 	VOP_DECREF(newdir);
 
 	return result;
@@ -290,6 +316,11 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+#if OPT_A3
+	if (result == 0) {
+		vfs_dcache_purgenegative(parent->vn_fs);
+	}
+#endif
 
 	VOP_DECREF(parent);
 
@@ -312,6 +343,11 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+#if OPT_A3
+	if (result == 0) {
+		vfs_dcache_purge(parent->vn_fs);
+	}
+#endif
 
 	VOP_DECREF(parent);
 
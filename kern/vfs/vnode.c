@@ -36,6 +36,7 @@
 #include <synch.h>
 #include <vfs.h>
 #include <vnode.h>
+#include "opt-A3.h"
 
 /*
  * Initialize an abstract vnode.
@@ -51,6 +52,9 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	vn->vn_ops = ops;
 	vn->vn_refcount = 1;
 	vn->vn_opencount = 0;
+#if OPT_A3
+	spinlock_init(&vn->vn_countlock);
+#endif
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
 	return 0;
@@ -66,6 +70,9 @@ vnode_cleanup(struct vnode *vn)
 	KASSERT(vn->vn_refcount==1);
 	KASSERT(vn->vn_opencount==0);
 
+#if OPT_A3
+	spinlock_cleanup(&vn->vn_countlock);
+#endif
 	vn->vn_ops = NULL;
 	vn->vn_refcount = 0;
 	vn->vn_opencount = 0;
@@ -83,11 +90,17 @@ vnode_incref(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
+#if OPT_A3
+	spinlock_acquire(&vn->vn_countlock);
+	vn->vn_refcount++;
+	spinlock_release(&vn->vn_countlock);
+#else
 	vfs_biglock_acquire();
 
 	vn->vn_refcount++;
 
 	vfs_biglock_release();
+#endif
 }
 
 /*
@@ -99,9 +112,33 @@ void
 vnode_decref(struct vnode *vn)
 {
 	int result;
+#if OPT_A3
+	bool destroy;
+#endif
 
 	KASSERT(vn != NULL);
 
+#if OPT_A3
+	spinlock_acquire(&vn->vn_countlock);
+	KASSERT(vn->vn_refcount>0);
+	if (vn->vn_refcount>1) {
+		vn->vn_refcount--;
+		destroy = false;
+	}
+	else {
+		destroy = true;
+	}
+	spinlock_release(&vn->vn_countlock);
+
+	if (destroy) {
+		result = VOP_RECLAIM(vn);
+		if (result != 0 && result != EBUSY) {
+			// XXX: lame.
+			kprintf("vfs: Warning: VOP_RECLAIM: %s\n",
+				strerror(result));
+		}
+	}
+#else
 	vfs_biglock_acquire();
 
 	KASSERT(vn->vn_refcount>0);
@@ -118,6 +155,7 @@ vnode_decref(struct vnode *vn)
 	}
 
 	vfs_biglock_release();
+#endif
 }
 
 /*
@@ -129,9 +167,15 @@ vnode_incopen(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
+#if OPT_A3
+	spinlock_acquire(&vn->vn_countlock);
+	vn->vn_opencount++;
+	spinlock_release(&vn->vn_countlock);
+#else
 	vfs_biglock_acquire();
 	vn->vn_opencount++;
 	vfs_biglock_release();
+#endif
 }
 
 /*
@@ -145,6 +189,17 @@ vnode_decopen(struct vnode *vn)
 
 	KASSERT(vn != NULL);
 
+#if OPT_A3
+	spinlock_acquire(&vn->vn_countlock);
+	KASSERT(vn->vn_opencount>0);
+	vn->vn_opencount--;
+
+	if (vn->vn_opencount > 0) {
+		spinlock_release(&vn->vn_countlock);
+		return;
+	}
+	spinlock_release(&vn->vn_countlock);
+#else
 	vfs_biglock_acquire();
 
 	KASSERT(vn->vn_opencount>0);
@@ -154,6 +209,7 @@ vnode_decopen(struct vnode *vn)
 		vfs_biglock_release();
 		return;
 	}
+#endif
 
 	result = VOP_CLOSE(vn);
 	if (result) {
@@ -163,7 +219,9 @@ vnode_decopen(struct vnode *vn)
 		kprintf("vfs: Warning: VOP_CLOSE: %s\n", strerror(result));
 	}
 
+#if !OPT_A3
 	vfs_biglock_release();
+#endif
 }
 
 /*
@@ -173,7 +231,13 @@ vnode_decopen(struct vnode *vn)
 void
 vnode_check(struct vnode *v, const char *opstr)
 {
+	/*
+	 * With OPT_A3 this runs unlocked; the counts it looks at may be
+	 * changing under it, but it's only a sanity check.
+	 */
+#if !OPT_A3
 	vfs_biglock_acquire();
+#endif
 
 	if (v == NULL) {
 		panic("vnode_check: vop_%s: null vnode\n", opstr);
@@ -223,5 +287,7 @@ vnode_check(struct vnode *v, const char *opstr)
 			opstr, v->vn_opencount);
 	}
 
+#if !OPT_A3
 	vfs_biglock_release();
+#endif
 }
@@ -73,7 +73,10 @@ fill_deadbeef(void *vptr, size_t len)
 //    The free counts and addresses of the pages are maintained in
 //    another list.  Maintaining this table is a nuisance, because it
 //    cannot recursively use the subpage allocator. (We could probably
-//    make that work, but it would be painful.)
+//    make that work, but it would be painful.) So the pagerefs come in
+//    whole pages of their own, straight from alloc_kpages, and kfree
+//    finds the pageref for a pointer through a small hash table keyed
+//    on the page address.
 //
 
 #undef  SLOW	/* consistency checks */
@@ -103,7 +106,7 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
-	struct pageref *next_all;
+	struct pageref *next_hash;	/* hash chain; free list when unused */
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -118,73 +121,78 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Pagerefs are handed out from a free list, which is refilled a page
+ * at a time. The first page's worth is in the kernel BSS, so early
+ * kmallocs don't need to allocate any; pages of pagerefs are never
+ * given back. Each pageref manages one page of heap, so a page of
+ * them (256) covers 1M of subpage heap and the heap can grow as far
+ * as memory does.
  */
 
 #define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
 static struct pageref pagerefs[NPAGEREFS];
+static bool pagerefs_bss_used;
+static struct pageref *freerefs;
+static unsigned npagerefs;	/* total, free or not */
+static unsigned npagerefs_inuse;
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static
+void
+addpagerefs(struct pageref *prs, unsigned n)
+{
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		prs[i].next_hash = freerefs;
+		freerefs = &prs[i];
+	}
+	npagerefs += n;
+}
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *p;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	if (freerefs == NULL && !pagerefs_bss_used) {
+		pagerefs_bss_used = true;
+		addpagerefs(pagerefs, NPAGEREFS);
 	}
 
-	/* ran out */
-	return NULL;
+	if (freerefs == NULL) {
+		/* ran out */
+		return NULL;
+	}
+	p = freerefs;
+	freerefs = p->next_hash;
+	p->next_hash = NULL;
+	npagerefs_inuse++;
+	return p;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT(npagerefs_inuse > 0);
+	npagerefs_inuse--;
+	p->next_hash = freerefs;
+	freerefs = p;
 }
 
 ////////////////////////////////////////
 
+/*
+ * Every page in use is on the list for its size and in the hash
+ * table, which kfree uses to find the pageref for a pointer.
+ */
+
+#define PRHASH_SIZE 256
+#define PRHASH(pageaddr) (((pageaddr) / PAGE_SIZE) % PRHASH_SIZE)
+
 static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+static struct pageref *prhash[PRHASH_SIZE];
 
 ////////////////////////////////////////
 
@@ -260,18 +268,21 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefs_inuse);
 			sc++;
 		}
 	}
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
-		ac++;
+	for (i=0; i<PRHASH_SIZE; i++) {
+		for (pr = prhash[i]; pr != NULL; pr = pr->next_hash) {
+			checksubpage(pr);
+			KASSERT(PRHASH(PR_PAGEADDR(pr)) == (unsigned)i);
+			KASSERT(ac < npagerefs_inuse);
+			ac++;
+		}
 	}
 
-	KASSERT(sc==ac);
+	KASSERT(sc==ac && sc==npagerefs_inuse);
 }
 #else
 #define checksubpages() 
@@ -334,16 +345,32 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned i, npages[NSIZES], nblocks[NSIZES], nfree[NSIZES];
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
 	kprintf("Subpage allocator status:\n");
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		dumpsubpage(pr);
+	for (i=0; i<NSIZES; i++) {
+		npages[i] = nblocks[i] = nfree[i] = 0;
+		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+			dumpsubpage(pr);
+			npages[i]++;
+			nblocks[i] += PAGE_SIZE / sizes[i];
+			nfree[i] += pr->nfree;
+		}
 	}
 
+	kprintf("Utilization by size:\n");
+	for (i=0; i<NSIZES; i++) {
+		kprintf("  %4lu: %4u pages, %5u/%5u blocks in use (%3u%%)\n",
+			(unsigned long) sizes[i], npages[i],
+			nblocks[i] - nfree[i], nblocks[i],
+			nblocks[i] ? 100 * (nblocks[i] - nfree[i]) / nblocks[i] : 0);
+	}
+	kprintf("  %u of %u pagerefs in use\n", npagerefs_inuse, npagerefs);
+
 	spinlock_release(&kmalloc_spinlock);
 }
 
@@ -365,10 +392,11 @@ remove_lists(struct pageref *pr, int blktype)
 		}
 	}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
+	for (guy = &prhash[PRHASH(PR_PAGEADDR(pr))]; *guy;
+	     guy = &(*guy)->next_hash) {
 		checksubpage(*guy);
 		if (*guy == pr) {
-			*guy = pr->next_all;
+			*guy = pr->next_hash;
 			break;
 		}
 	}
@@ -399,6 +427,7 @@ subpage_kmalloc(size_t sz)
 	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t refpage;	// new page of pagerefs, if we need one
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
 	void *retptr;		// our result
@@ -470,11 +499,19 @@ subpage_kmalloc(size_t sz)
 
 	pr = allocpageref();
 	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+		/* Out of pagerefs; get another page of them, again unlocked. */
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		refpage = alloc_kpages(1);
+		if (refpage==0) {
+			/* Couldn't allocate accounting space for the new page. */
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
+			return NULL;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		addpagerefs((struct pageref *)refpage, NPAGEREFS);
+		pr = allocpageref();
+		KASSERT(pr != NULL);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -501,8 +538,8 @@ subpage_kmalloc(size_t sz)
 	pr->next_samesize = sizebases[blktype];
 	sizebases[blktype] = pr;
 
-	pr->next_all = allbase;
-	allbase = pr;
+	pr->next_hash = prhash[PRHASH(prpage)];
+	prhash[PRHASH(prpage)] = pr;
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
@@ -526,15 +563,9 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+	prpage = ptraddr & PAGE_FRAME;
+	for (pr = prhash[PRHASH(prpage)]; pr; pr = pr->next_hash) {
+		if (PR_PAGEADDR(pr) == prpage) {
 			break;
 		}
 	}
@@ -545,6 +576,12 @@ subpage_kfree(void *ptr)
 		return -1;
 	}
 
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
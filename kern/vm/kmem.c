@@ -0,0 +1,312 @@
+/*
+ * Object caches. See kmem.h for the interface.
+ *
+ * Each slab is one page from alloc_kpages, with a struct kmem_slab at
+ * the start and the objects packed after it, so the slab an object
+ * belongs to is found by rounding its address down to the page. Slabs
+ * that still have free objects are kept on the cache's partial list;
+ * full slabs are on no list at all. One completely free slab is kept
+ * around per cache, any more go back to the VM system.
+ *
+ * The per-cpu magazines are only touched by their own cpu with
+ * interrupts off; everything else is protected by the cache's spinlock.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <platform/maxcpus.h>
+#include <kmem.h>
+
+/* Objects per magazine, and how many a full magazine gives back at once */
+#define KMEM_MAGSIZE 8
+#define KMEM_MAGDRAIN (KMEM_MAGSIZE / 2)
+
+/* All objects are aligned at least this much, like kmalloc's */
+#define KMEM_ALIGN 8
+
+/*
+ * Free objects are chained through a link word. Without a constructor
+ * it overlays the start of the object; with one it goes after the
+ * object, so constructed state survives being on the free list.
+ */
+struct kmem_object {
+	struct kmem_object *ko_next;
+};
+
+#define KMEM_LINK(kc, obj) \
+	((struct kmem_object *)((vaddr_t)(obj) + (kc)->kc_linkoff))
+#define KMEM_OBJ(kc, link) ((void *)((vaddr_t)(link) - (kc)->kc_linkoff))
+
+struct kmem_slab {
+	struct kmem_cache *ks_cache;
+	struct kmem_slab *ks_next;	/* partial list links */
+	struct kmem_slab *ks_prev;
+	struct kmem_object *ks_free;
+	unsigned ks_nfree;
+};
+
+#define KMEM_SLABHDR ROUNDUP(sizeof(struct kmem_slab), KMEM_ALIGN)
+
+struct kmem_magazine {
+	unsigned km_count;
+	void *km_objs[KMEM_MAGSIZE];
+};
+
+struct kmem_cache {
+	char *kc_name;
+	size_t kc_size;			/* object spacing in a slab */
+	size_t kc_linkoff;		/* offset of the free list link */
+	unsigned kc_perslab;
+	void (*kc_ctor)(void *obj);
+	struct spinlock kc_lock;
+	struct kmem_slab *kc_partial;
+	unsigned kc_nempty;		/* completely free slabs on kc_partial */
+	struct kmem_magazine kc_mags[MAXCPUS];
+};
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0 && size <= KMEM_MAXSIZE);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = kstrdup(name);
+	if (kc->kc_name == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+
+	if (ctor != NULL) {
+		kc->kc_linkoff = ROUNDUP(size, sizeof(struct kmem_object));
+		size = kc->kc_linkoff + sizeof(struct kmem_object);
+	} else {
+		kc->kc_linkoff = 0;
+		if (size < sizeof(struct kmem_object)) {
+			size = sizeof(struct kmem_object);
+		}
+	}
+	kc->kc_size = ROUNDUP(size, KMEM_ALIGN);
+	kc->kc_perslab = (PAGE_SIZE - KMEM_SLABHDR) / kc->kc_size;
+	kc->kc_ctor = ctor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = NULL;
+	kc->kc_nempty = 0;
+	for (int i = 0; i < MAXCPUS; i++) {
+		kc->kc_mags[i].km_count = 0;
+	}
+	return kc;
+}
+
+/* Link SLAB onto the front of the partial list. Call with kc_lock held. */
+static
+void
+kmem_partialInsert(struct kmem_cache *kc, struct kmem_slab *slab)
+{
+	slab->ks_prev = NULL;
+	slab->ks_next = kc->kc_partial;
+	if (kc->kc_partial != NULL) {
+		kc->kc_partial->ks_prev = slab;
+	}
+	kc->kc_partial = slab;
+}
+
+/* Unlink SLAB from the partial list. Call with kc_lock held. */
+static
+void
+kmem_partialRemove(struct kmem_cache *kc, struct kmem_slab *slab)
+{
+	if (slab->ks_prev != NULL) {
+		slab->ks_prev->ks_next = slab->ks_next;
+	} else {
+		kc->kc_partial = slab->ks_next;
+	}
+	if (slab->ks_next != NULL) {
+		slab->ks_next->ks_prev = slab->ks_prev;
+	}
+	slab->ks_next = slab->ks_prev = NULL;
+}
+
+/*
+ * Get a fresh page and cut it up into constructed objects.
+ */
+static
+struct kmem_slab *
+kmem_slabCreate(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	struct kmem_object *link;
+	void *obj;
+	vaddr_t page;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	slab = (struct kmem_slab *)page;
+	slab->ks_cache = kc;
+	slab->ks_next = slab->ks_prev = NULL;
+	slab->ks_free = NULL;
+	slab->ks_nfree = kc->kc_perslab;
+
+	//build the free list backwards so objects are handed out in address order
+	for (unsigned i = kc->kc_perslab; i-- > 0; ) {
+		obj = (void *)(page + KMEM_SLABHDR + i * kc->kc_size);
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctor(obj);
+		}
+		link = KMEM_LINK(kc, obj);
+		link->ko_next = slab->ks_free;
+		slab->ks_free = link;
+	}
+	return slab;
+}
+
+static
+void *
+kmem_slabAlloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	struct kmem_object *link;
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_partial == NULL) {
+		/* Don't hold the spinlock across alloc_kpages. */
+		spinlock_release(&kc->kc_lock);
+		slab = kmem_slabCreate(kc);
+		if (slab == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		kmem_partialInsert(kc, slab);
+		kc->kc_nempty++;
+	}
+
+	slab = kc->kc_partial;
+	KASSERT(slab->ks_nfree > 0);
+	if (slab->ks_nfree == kc->kc_perslab) {
+		kc->kc_nempty--;
+	}
+	link = slab->ks_free;
+	slab->ks_free = link->ko_next;
+	slab->ks_nfree--;
+	if (slab->ks_nfree == 0) {
+		kmem_partialRemove(kc, slab);
+	}
+	spinlock_release(&kc->kc_lock);
+
+	return KMEM_OBJ(kc, link);
+}
+
+/*
+ * Put objects back into their slabs. Call with kc_lock held; hands
+ * back a slab page to be freed (after unlocking) or 0.
+ */
+static
+vaddr_t
+kmem_slabFree(struct kmem_cache *kc, void *ptr)
+{
+	struct kmem_slab *slab;
+	struct kmem_object *link = KMEM_LINK(kc, ptr);
+
+	slab = (struct kmem_slab *)((vaddr_t)ptr & PAGE_FRAME);
+	KASSERT(slab->ks_cache == kc);
+	KASSERT(slab->ks_nfree < kc->kc_perslab);
+
+	link->ko_next = slab->ks_free;
+	slab->ks_free = link;
+	if (slab->ks_nfree++ == 0) {
+		kmem_partialInsert(kc, slab);
+	}
+	if (slab->ks_nfree < kc->kc_perslab) {
+		return 0;
+	}
+
+	//keep one free slab around so an alloc/free pair at a slab boundary
+	//doesn't keep going to the VM system
+	if (kc->kc_nempty == 0) {
+		kc->kc_nempty++;
+		return 0;
+	}
+	kmem_partialRemove(kc, slab);
+	return (vaddr_t)slab;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_magazine *mag;
+	void *obj;
+	int spl;
+
+	/* No magazines until this cpu is fully set up. */
+	if (CURCPU_EXISTS()) {
+		spl = splhigh();
+		mag = &kc->kc_mags[curcpu->c_number];
+		if (mag->km_count > 0) {
+			obj = mag->km_objs[--mag->km_count];
+			splx(spl);
+			return obj;
+		}
+		splx(spl);
+	}
+	return kmem_slabAlloc(kc);
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_magazine *mag;
+	void *drain[KMEM_MAGDRAIN];
+	vaddr_t pages[KMEM_MAGDRAIN + 1];
+	unsigned ndrain = 0, npages = 0;
+	vaddr_t page;
+	int spl;
+
+	KASSERT(obj != NULL);
+
+	if (CURCPU_EXISTS()) {
+		spl = splhigh();
+		mag = &kc->kc_mags[curcpu->c_number];
+		if (mag->km_count == KMEM_MAGSIZE) {
+			//full: take the oldest half out to give back to the slabs
+			ndrain = KMEM_MAGDRAIN;
+			for (unsigned i = 0; i < ndrain; i++) {
+				drain[i] = mag->km_objs[i];
+			}
+			for (unsigned i = ndrain; i < KMEM_MAGSIZE; i++) {
+				mag->km_objs[i - ndrain] = mag->km_objs[i];
+			}
+			mag->km_count -= ndrain;
+		}
+		mag->km_objs[mag->km_count++] = obj;
+		splx(spl);
+		if (ndrain == 0) {
+			return;
+		}
+	} else {
+		drain[ndrain++] = obj;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	for (unsigned i = 0; i < ndrain; i++) {
+		page = kmem_slabFree(kc, drain[i]);
+		if (page != 0) {
+			pages[npages++] = page;
+		}
+	}
+	spinlock_release(&kc->kc_lock);
+
+	for (unsigned i = 0; i < npages; i++) {
+		free_kpages(pages[i]);
+	}
+}
@@ -95,12 +95,40 @@ dodirblock(uint32_t block)
 	}
 }
 
+/*
+ * Dump the directory blocks under indirect block IBLOCK, which is
+ * INDIRECTION levels above the data: 1 for a single indirect block,
+ * 2 for a double indirect block, 3 for a triple.
+ */
+static
+void
+dumpindir(uint32_t iblock, int indirection, uint32_t *nblocks)
+{
+	uint32_t ib[SFS_DBPERIDB];
+	uint32_t block;
+	int i;
+
+	diskread(&ib, iblock);
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		block = SWAPL(ib[i]);
+		if (block == 0) {
+			continue;
+		}
+		if (indirection > 1) {
+			dumpindir(block, indirection-1, nblocks);
+		}
+		else {
+			dodirblock(block);
+			(*nblocks)++;
+		}
+	}
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
 	int nentries, i;
 	uint32_t block, nblocks=0;
 
@@ -120,14 +148,13 @@ dumpdir(uint32_t ino)
 		}
 	}
 	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
+		dumpindir(SWAPL(sfi.sfi_indirect), 1, &nblocks);
+	}
+	if (SWAPL(sfi.sfi_dindirect)) {
+		dumpindir(SWAPL(sfi.sfi_dindirect), 2, &nblocks);
+	}
+	if (SWAPL(sfi.sfi_tindirect)) {
+		dumpindir(SWAPL(sfi.sfi_tindirect), 3, &nblocks);
 	}
 	printf("    %u blocks in directory\n", nblocks);
 }
@@ -565,19 +565,26 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 		     int isdir, int indirection)
 {
 	uint32_t entries[SFS_DBPERIDB];
-	uint32_t i, ct;
-
-	if (*ientry !=0) {
-		diskread(entries, *ientry);
-		swapindir(entries);
-		bitmap_mark(*ientry, B_IBLOCK, ino);
-	}
-	else {
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			entries[i] = 0;
+	uint32_t i, ct, span;
+
+	if (*ientry == 0) {
+		/*
+		 * Nothing to check; just skip the blocks it would map.
+		 * (Walking the empty tree of a triple indirect block
+		 * would take 128^3 steps per inode.)
+		 */
+		span = SFS_DBPERIDB;
+		for (i=1; i<(uint32_t)indirection; i++) {
+			span *= SFS_DBPERIDB;
 		}
+		*blockp += span;
+		return;
 	}
 
+	diskread(entries, *ientry);
+	swapindir(entries);
+	bitmap_mark(*ientry, B_IBLOCK, ino);
+
 	if (indirection > 1) {
 		for (i=0; i<SFS_DBPERIDB; i++) {
 			check_indirect_block(ino, &entries[i], 
@@ -0,0 +1,117 @@
+/*
+ * forkreuse - fork from pages that have been freed and reused.
+ *
+ * Usage: forkreuse [rounds]
+ *
+ * Each round forks a child that writes to every page of a large
+ * array, so the kernel has to hand it frames that earlier children
+ * freed when they exited. The child then forks a grandchild, which
+ * shares those frames copy-on-write, and both check and change the
+ * data before exiting. A frame that came back from the free list in
+ * a bad state shows up as wrong data or a kernel panic.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE 4096
+#define NPAGES   64
+
+static volatile char pages[NPAGES * PAGESIZE];
+
+static
+void
+fill(int seed)
+{
+	int i;
+
+	for (i=0; i<NPAGES; i++) {
+		pages[i * PAGESIZE] = (char)(seed + i);
+		pages[i * PAGESIZE + PAGESIZE - 1] = (char)(seed - i);
+	}
+}
+
+static
+void
+verify(int seed, const char *who)
+{
+	int i;
+
+	for (i=0; i<NPAGES; i++) {
+		if (pages[i * PAGESIZE] != (char)(seed + i) ||
+		    pages[i * PAGESIZE + PAGESIZE - 1] != (char)(seed - i)) {
+			errx(1, "%s: page %d has the wrong data", who, i);
+		}
+	}
+}
+
+/*
+ * Wait for PID and return nonzero if it didn't exit cleanly.
+ */
+static
+int
+reap(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+static
+int
+child(int round)
+{
+	pid_t pid;
+
+	fill(round);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		verify(round, "grandchild");
+		fill(round + 1);
+		verify(round + 1, "grandchild");
+		_exit(0);
+	}
+	/* The grandchild's writes must not show up here */
+	fill(round + 2);
+	if (reap(pid)) {
+		return 1;
+	}
+	verify(round + 2, "child");
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int rounds = 20, i;
+	pid_t pid;
+
+	if (argc > 1) {
+		rounds = atoi(argv[1]);
+	}
+
+	for (i=0; i<rounds; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			_exit(child(i));
+		}
+		if (reap(pid)) {
+			errx(1, "round %d failed", i);
+		}
+	}
+	printf("forkreuse: %d rounds passed\n", rounds);
+	return 0;
+}
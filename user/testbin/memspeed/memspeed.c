@@ -0,0 +1,229 @@
+/*
+ * memspeed - measure memcpy, memmove and bzero throughput.
+ *
+ * Usage: memspeed [kbytes]
+ *
+ * For each block size, and for each combination of source and
+ * destination offsets from a word boundary, moves KBYTES kilobytes
+ * (default 4096) in blocks of that size and prints the rate in KB/s.
+ * The libc routines used here are the same code the kernel uses for
+ * copyin, copyout and uiomove.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define MAXBLOCK 16384
+
+/* Room for a block at any offset, plus a second for memmove overlap */
+static char srcbuf[MAXBLOCK + 64];
+static char dstbuf[MAXBLOCK + 64];
+
+static const unsigned sizes[] = { 16, 64, 256, 1024, 4096, MAXBLOCK };
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+enum op { OP_MEMCPY, OP_MEMMOVE, OP_BZERO };
+static const char *const opnames[] = { "memcpy", "memmove", "bzero" };
+
+static
+unsigned
+now_ms(void)
+{
+	time_t s;
+	unsigned long ns;
+
+	__time(&s, &ns);
+	return s * 1000 + ns / 1000000;
+}
+
+/*
+ * Move TOTAL bytes in SIZE-byte blocks and return the rate in KB/s.
+ * memmove copies within one buffer, up by 8 bytes, so that the
+ * regions overlap and it has to go backwards.
+ */
+static
+unsigned
+run(enum op op, unsigned size, unsigned soff, unsigned doff, unsigned total)
+{
+	unsigned n, i, start, ms;
+
+	n = total / size;
+	start = now_ms();
+	for (i=0; i<n; i++) {
+		switch (op) {
+		    case OP_MEMCPY:
+			memcpy(dstbuf + doff, srcbuf + soff, size);
+			break;
+		    case OP_MEMMOVE:
+			memmove(srcbuf + soff + 8 + doff, srcbuf + soff, size);
+			break;
+		    case OP_BZERO:
+			bzero(dstbuf + doff, size);
+			break;
+		}
+	}
+	ms = now_ms() - start;
+	if (ms == 0) {
+		ms = 1;
+	}
+	return (unsigned)((unsigned long long)n * size / 1024 * 1000 / ms);
+}
+
+/*
+ * Make sure the routines actually work at every offset before timing
+ * them. Each check works on a copy of the buffer made a byte at a
+ * time, so the expected result doesn't depend on the code under test.
+ */
+#define CHECKLEN 100
+
+static char expect[CHECKLEN + 64];
+
+static
+void
+pattern(char *buf, unsigned len)
+{
+	unsigned i;
+
+	for (i=0; i<len; i++) {
+		buf[i] = (char)(i * 7 + 1);
+	}
+}
+
+static
+void
+compare(const char *what, unsigned a, unsigned b, unsigned len)
+{
+	unsigned i;
+
+	for (i=0; i<sizeof(expect); i++) {
+		if (dstbuf[i] != expect[i]) {
+			errx(1, "%s wrong at %u/%u/%u (byte %u)", what, a, b,
+			     len, i);
+		}
+	}
+}
+
+static
+void
+check_memcpy(void)
+{
+	unsigned soff, doff, len, i;
+
+	pattern(srcbuf, sizeof(expect));
+	for (soff=0; soff<8; soff++) {
+		for (doff=0; doff<8; doff++) {
+			for (len=0; len<CHECKLEN; len++) {
+				for (i=0; i<sizeof(expect); i++) {
+					dstbuf[i] = expect[i] = 0x55;
+				}
+				for (i=0; i<len; i++) {
+					expect[doff+i] = srcbuf[soff+i];
+				}
+				memcpy(dstbuf + doff, srcbuf + soff, len);
+				compare("memcpy", soff, doff, len);
+			}
+		}
+	}
+}
+
+/*
+ * Overlapping moves within dstbuf: the destination starts 8 bytes
+ * below, at, or 8 bytes above the source, then each is moved by its
+ * own offset, so every alignment is tried going both forwards and
+ * backwards.
+ */
+static
+void
+check_memmove(void)
+{
+	unsigned soff, doff, len, i, shift, src, dst;
+
+	for (shift=0; shift<3; shift++) {
+		for (soff=0; soff<8; soff++) {
+			for (doff=0; doff<8; doff++) {
+				for (len=0; len<CHECKLEN; len++) {
+					src = 16 + soff;
+					dst = 8 + shift * 8 + doff;
+					pattern(dstbuf, sizeof(expect));
+					pattern(expect, sizeof(expect));
+					for (i=0; i<len; i++) {
+						expect[dst+i] = dstbuf[src+i];
+					}
+					memmove(dstbuf + dst, dstbuf + src,
+						len);
+					compare("memmove", src, dst, len);
+				}
+			}
+		}
+	}
+}
+
+static
+void
+check_bzero(void)
+{
+	unsigned off, len, i;
+
+	for (off=0; off<8; off++) {
+		for (len=0; len<CHECKLEN; len++) {
+			for (i=0; i<sizeof(expect); i++) {
+				dstbuf[i] = expect[i] = 0x55;
+			}
+			for (i=0; i<len; i++) {
+				expect[off+i] = 0;
+			}
+			bzero(dstbuf + off, len);
+			/* compare covers the guard bytes on either side */
+			compare("bzero", off, 0, len);
+		}
+	}
+}
+
+static
+void
+check(void)
+{
+	check_memcpy();
+	check_memmove();
+	check_bzero();
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned kbytes = 4096, total, i, op, soff, doff;
+
+	if (argc > 1) {
+		kbytes = atoi(argv[1]);
+	}
+	if (kbytes == 0) {
+		errx(1, "usage: memspeed [kbytes]");
+	}
+	total = kbytes * 1024;
+
+	check();
+
+	for (op = OP_MEMCPY; op <= OP_BZERO; op++) {
+		printf("%s, KB/s (source+destination offset):\n",
+		       opnames[op]);
+		for (i=0; i<NSIZES; i++) {
+			printf("  %5u bytes:", sizes[i]);
+			for (soff=0; soff<4; soff++) {
+				for (doff=0; doff<4; doff++) {
+					if (op == OP_BZERO && soff > 0) {
+						continue;
+					}
+					printf(" %u+%u %u", soff, doff,
+					       run(op, sizes[i], soff, doff,
+						   total));
+				}
+			}
+			printf("\n");
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * pipebench - measure pipe throughput.
+ *
+ * Usage: pipebench [kbytes [chunksize]]
+ *
+ * Forks a child that writes KBYTES kilobytes (default 4096) into a
+ * pipe CHUNKSIZE bytes (default 1024) at a time, while the parent
+ * reads them out the same way, checks the data, and reports how long
+ * it took and the rate.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define MAXCHUNK 16384
+
+static char buf[MAXCHUNK];
+
+/*
+ * The data is a running byte count, so a lost, repeated, or
+ * misplaced byte shows up.
+ */
+static
+void
+fill(unsigned pos, unsigned len)
+{
+	unsigned i;
+
+	for (i=0; i<len; i++) {
+		buf[i] = (char)(pos + i);
+	}
+}
+
+static
+void
+producer(int fd, unsigned total, unsigned chunk)
+{
+	unsigned pos, len;
+	int r;
+
+	for (pos = 0; pos < total; pos += len) {
+		len = total - pos < chunk ? total - pos : chunk;
+		fill(pos, len);
+		r = write(fd, buf, len);
+		if (r < 0) {
+			err(1, "write");
+		}
+		if ((unsigned)r != len) {
+			errx(1, "short write: %d of %u bytes", r, len);
+		}
+	}
+}
+
+static
+void
+consumer(int fd, unsigned total, unsigned chunk)
+{
+	unsigned pos, i;
+	int r;
+
+	pos = 0;
+	while (1) {
+		r = read(fd, buf, chunk);
+		if (r < 0) {
+			err(1, "read");
+		}
+		if (r == 0) {
+			break;
+		}
+		for (i=0; i<(unsigned)r; i++) {
+			if (buf[i] != (char)(pos + i)) {
+				errx(1, "wrong data at byte %u", pos + i);
+			}
+		}
+		pos += r;
+	}
+	if (pos != total) {
+		errx(1, "read %u bytes, expected %u", pos, total);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned kbytes = 4096, chunk = 1024, total;
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	unsigned ms;
+	int fds[2], status;
+	pid_t pid;
+
+	if (argc > 1) {
+		kbytes = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		chunk = atoi(argv[2]);
+	}
+	if (kbytes == 0 || chunk == 0 || chunk > MAXCHUNK) {
+		errx(1, "usage: pipebench [kbytes [chunksize <= %d]]",
+		     MAXCHUNK);
+	}
+	total = kbytes * 1024;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+
+	__time(&s0, &ns0);
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		producer(fds[1], total, chunk);
+		close(fds[1]);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	consumer(fds[0], total, chunk);
+	close(fds[0]);
+
+	__time(&s1, &ns1);
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "producer failed");
+	}
+
+	ms = (s1 - s0) * 1000 + ((long)ns1 - (long)ns0) / 1000000;
+	if (ms == 0) {
+		ms = 1;
+	}
+	printf("pipebench: %u KB in %u-byte chunks in %u.%03u s: %u KB/s\n",
+	       kbytes, chunk, ms / 1000, ms % 1000,
+	       (unsigned)((unsigned long long)kbytes * 1000 / ms));
+	return 0;
+}